@@ -16,8 +16,10 @@
 #include <linux/buffer_head.h>
 #include <linux/bitops.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
 
-static DEFINE_SPINLOCK(bitmap_lock);
 
 /*
  * bitmap consists of blocks filled with 16bit words
@@ -41,7 +43,11 @@ static __u32 count_free(struct buffer_head *map[], unsigned blocksize, __u32 num
 
 void cominix_free_block(struct inode *inode, unsigned long block)
 {
-	struct super_block *sb = inode->i_sb;
+	cominix_free_block_sb(inode->i_sb, block);
+}
+
+void cominix_free_block_sb(struct super_block *sb, unsigned long block)
+{
 	struct cominix_sb_info *sbi = cominix_sb(sb);
 	struct buffer_head *bh;
 	int k = sb->s_blocksize_bits + 3;
@@ -59,74 +65,225 @@ void cominix_free_block(struct inode *inode, unsigned long block)
 		return;
 	}
 	bh = sbi->s_zmap[zone];
-	spin_lock(&bitmap_lock);
+	spin_lock(&sbi->bitmap_lock);
 	if (!cominix_test_and_clear_bit(bit, bh->b_data))
 		printk("cominix_free_block (%s:%lu): bit already cleared\n",
 		       sb->s_id, block);
-	spin_unlock(&bitmap_lock);
+	else {
+		sbi->s_zmap_free[zone]++;
+		percpu_counter_inc(&sbi->s_freezones_counter);
+	}
+	spin_unlock(&sbi->bitmap_lock);
 	mark_buffer_dirty(bh);
 	return;
 }
 
-int cominix_new_block(struct inode * inode)
+/* bits of zmap block i that stand for real zones */
+static unsigned zmap_bits(struct super_block *sb, unsigned long i)
 {
-	struct cominix_sb_info *sbi = cominix_sb(inode->i_sb);
-	int bits_per_zone = 8 * inode->i_sb->s_blocksize;
-	int i;
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	unsigned long bits_per_zone = 8 * sb->s_blocksize;
+	unsigned long total = sbi->s_nzones - sbi->s_firstdatazone + 1;
 
-	for (i = 0; i < sbi->s_zmap_blocks; i++) {
-		struct buffer_head *bh = sbi->s_zmap[i];
-		int j;
+	if (i * bits_per_zone >= total)
+		return 0;
+	return min(total - i * bits_per_zone, bits_per_zone);
+}
 
-		spin_lock(&bitmap_lock);
-		j = cominix_find_first_zero_bit(bh->b_data, bits_per_zone);
-		if (j < bits_per_zone) {
-			cominix_set_bit(j, bh->b_data);
-			spin_unlock(&bitmap_lock);
-			mark_buffer_dirty(bh);
-			j += i * bits_per_zone + sbi->s_firstdatazone-1;
-			if (j < sbi->s_firstdatazone || j >= sbi->s_nzones)
-				break;
-			return j;
-		}
-		spin_unlock(&bitmap_lock);
+/*
+ * Counts the free zones in every zmap block so the allocator can skip the
+ * full ones, and the free zones and inodes overall so statfs doesn't have
+ * to. Called once the bitmaps are read in.
+ */
+int cominix_init_free_counts(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	unsigned long i, total = 0;
+
+	sbi->s_zmap_free = kcalloc(sbi->s_zmap_blocks, sizeof(u32), GFP_KERNEL);
+	if (!sbi->s_zmap_free)
+		return -ENOMEM;
+	for (i = 0; i < sbi->s_zmap_blocks; i++) {
+		char *map = sbi->s_zmap[i]->b_data;
+		unsigned bits = zmap_bits(sb, i), j;
+		u32 free = 0;
+
+		/* whole words don't care about bit order */
+		for (j = 0; j + 16 <= bits; j += 16)
+			free += 16 - hweight16(*(__u16 *)(map + j / 8));
+		for (; j < bits; j++)
+			free += !cominix_test_bit(j, map);
+		sbi->s_zmap_free[i] = free;
+		total += free;
 	}
+	sbi->s_zone_cursor = 0;
+
+	if (percpu_counter_init(&sbi->s_freezones_counter, total, GFP_KERNEL))
+		goto out_zmap;
+	if (percpu_counter_init(&sbi->s_freeinodes_counter,
+			count_free(sbi->s_imap, sb->s_blocksize, sbi->s_ninodes + 1),
+			GFP_KERNEL))
+		goto out_zones;
+	if (percpu_counter_init(&sbi->s_dirtyzones_counter, 0, GFP_KERNEL))
+		goto out_inodes;
 	return 0;
+
+out_inodes:
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+out_zones:
+	percpu_counter_destroy(&sbi->s_freezones_counter);
+out_zmap:
+	kfree(sbi->s_zmap_free);
+	sbi->s_zmap_free = NULL;
+	return -ENOMEM;
 }
 
-int cominix_new_block_sb(struct super_block *sb)
+void cominix_destroy_free_counts(struct super_block *sb)
 {
 	struct cominix_sb_info *sbi = cominix_sb(sb);
-	int bits_per_zone = 8 * sb->s_blocksize;
-	int i;
 
-	for (i = 0; i < sbi->s_zmap_blocks; i++) {
-		struct buffer_head *bh = sbi->s_zmap[i];
-		int j;
+	percpu_counter_destroy(&sbi->s_dirtyzones_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	percpu_counter_destroy(&sbi->s_freezones_counter);
+	kfree(sbi->s_zmap_free);
+}
 
-		spin_lock(&bitmap_lock);
-		j = cominix_find_first_zero_bit(bh->b_data, bits_per_zone);
-		if (j < bits_per_zone) {
-			cominix_set_bit(j, bh->b_data);
-			spin_unlock(&bitmap_lock);
-			mark_buffer_dirty(bh);
-			j += i * bits_per_zone + sbi->s_firstdatazone-1;
-			if (j < sbi->s_firstdatazone || j >= sbi->s_nzones)
-				break;
-			return j;
-		}
-		spin_unlock(&bitmap_lock);
+/*
+ * Blocks written with delayed allocation are only counted here until
+ * writeback gives them a real place. Pointer and extent blocks aren't
+ * reserved one by one, they come out of a margin that grows with the
+ * reservations. An extent file written in scattered blocks is the worst
+ * case: full chain blocks split in two, so a new chain block every half
+ * cominix_extents_per_block blocks, which is more than the tree's one in
+ * every 256 pointers.
+ */
+static s64 dirty_margin(struct super_block *sb, s64 dirty)
+{
+	return div_s64(dirty, cominix_extents_per_block(sb) / 2) + 4;
+}
+
+/*
+ * How many of the count blocks asked for can be taken without using up
+ * what delayed writes were promised. Their own data was counted when it
+ * was reserved, so it's taken as is. What their writeback needs besides
+ * the data comes out of the margin. Everything else has to leave both
+ * alone, the same as ext4's claim.
+ */
+static int claim_blocks(struct super_block *sb, int count, int flags)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	s64 free, dirty, left;
+
+	if (flags & COMINIX_ALLOC_DELAYED)
+		return count;
+	free = percpu_counter_read_positive(&sbi->s_freezones_counter);
+	dirty = percpu_counter_read_positive(&sbi->s_dirtyzones_counter);
+	left = free - dirty;
+	if (!(flags & COMINIX_ALLOC_MARGIN))
+		left -= dirty_margin(sb, dirty);
+	//the quick reads can be off by a batch per cpu
+	if (left < count + 2 * percpu_counter_batch * num_online_cpus()) {
+		free = percpu_counter_sum_positive(&sbi->s_freezones_counter);
+		dirty = percpu_counter_sum_positive(&sbi->s_dirtyzones_counter);
+		left = free - dirty;
+		if (!(flags & COMINIX_ALLOC_MARGIN))
+			left -= dirty_margin(sb, dirty);
 	}
+	return clamp_t(s64, left, 0, count);
+}
+
+int cominix_reserve_block(struct super_block *sb)
+{
+	if (!claim_blocks(sb, 1, 0))
+		return -ENOSPC;
+	percpu_counter_inc(&cominix_sb(sb)->s_dirtyzones_counter);
 	return 0;
 }
 
+void cominix_release_blocks(struct super_block *sb, int count)
+{
+	percpu_counter_sub(&cominix_sb(sb)->s_dirtyzones_counter, count);
+}
+
+/*
+ * Allocates up to *count zones next to each other, starting the search at
+ * goal (a zone number, or 0 to carry on from the last allocation). Returns
+ * the first one and sets *count to how many were actually taken, which can
+ * be less: a run never crosses a zmap block. Returns 0 if the disk is full,
+ * or if the only free zones left are promised to delayed writes and flags
+ * doesn't say this is one of them.
+ */
+int cominix_new_blocks_sb(struct super_block *sb, unsigned long goal, int *count,
+			  int flags)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	unsigned long bits_per_zone = 8 * sb->s_blocksize;
+	unsigned long start, first, i, n;
+	unsigned bits, j;
+	int got;
+
+	*count = claim_blocks(sb, *count, flags);
+	if (!*count)
+		return 0;
+	spin_lock(&sbi->bitmap_lock);
+	if (goal >= sbi->s_firstdatazone && goal < sbi->s_nzones)
+		start = goal - sbi->s_firstdatazone + 1;
+	else
+		start = sbi->s_zone_cursor;
+	first = start / bits_per_zone;
+	if (first >= sbi->s_zmap_blocks)
+		first = start = 0;
+
+	/* one more than the number of blocks, the first one is looked at twice */
+	for (n = 0; n <= sbi->s_zmap_blocks; n++) {
+		char *map;
+
+		i = (first + n) % sbi->s_zmap_blocks;
+		if (!sbi->s_zmap_free[i])
+			continue;
+		bits = zmap_bits(sb, i);
+		map = sbi->s_zmap[i]->b_data;
+		j = cominix_find_next_zero_bit(map, bits,
+					       n ? 0 : start % bits_per_zone);
+		if (j >= bits)
+			continue;
+
+		for (got = 0; got < *count && j + got < bits &&
+			      !cominix_test_bit(j + got, map); got++)
+			cominix_set_bit(j + got, map);
+		sbi->s_zmap_free[i] -= got;
+		percpu_counter_sub(&sbi->s_freezones_counter, got);
+		sbi->s_zone_cursor = i * bits_per_zone + j + got;
+		spin_unlock(&sbi->bitmap_lock);
+		mark_buffer_dirty(sbi->s_zmap[i]);
+		*count = got;
+		return i * bits_per_zone + j + sbi->s_firstdatazone - 1;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+	*count = 0;
+	return 0;
+}
+
+int cominix_new_block_sb(struct super_block *sb)
+{
+	int count = 1;
+
+	return cominix_new_blocks_sb(sb, 0, &count, 0);
+}
+
+int cominix_new_block(struct inode * inode)
+{
+	return cominix_new_block_sb(inode->i_sb);
+}
+
 unsigned long cominix_count_free_blocks(struct super_block *sb)
 {
 	struct cominix_sb_info *sbi = cominix_sb(sb);
-	u32 bits = sbi->s_nzones - sbi->s_firstdatazone + 1;
 
-	return (count_free(sbi->s_zmap, sb->s_blocksize, bits)
-		<< sbi->s_log_zone_size);
+	s64 free = percpu_counter_read_positive(&sbi->s_freezones_counter) -
+		   percpu_counter_read_positive(&sbi->s_dirtyzones_counter);
+
+	return max_t(s64, free, 0) << sbi->s_log_zone_size;
 }
 
 struct cominix_inode *
@@ -229,10 +386,12 @@ void cominix_free_inode(struct inode * inode)
 	cominix_clear_inode(inode);	/* clear on-disk copy */
 
 	bh = sbi->s_imap[ino];
-	spin_lock(&bitmap_lock);
+	spin_lock(&sbi->bitmap_lock);
 	if (!cominix_test_and_clear_bit(bit, bh->b_data))
 		printk("cominix_free_inode: bit %lu already cleared\n", bit);
-	spin_unlock(&bitmap_lock);
+	else
+		percpu_counter_inc(&sbi->s_freeinodes_counter);
+	spin_unlock(&sbi->bitmap_lock);
 	mark_buffer_dirty(bh);
 }
 
@@ -250,7 +409,7 @@ struct inode *cominix_new_inode(const struct inode *dir, umode_t mode)
 		return ERR_PTR(-ENOMEM);
 	j = bits_per_zone;
 	bh = NULL;
-	spin_lock(&bitmap_lock);
+	spin_lock(&sbi->bitmap_lock);
 	for (i = 0; i < sbi->s_imap_blocks; i++) {
 		bh = sbi->s_imap[i];
 		j = cominix_find_first_zero_bit(bh->b_data, bits_per_zone);
@@ -258,17 +417,18 @@ struct inode *cominix_new_inode(const struct inode *dir, umode_t mode)
 			break;
 	}
 	if (!bh || j >= bits_per_zone) {
-		spin_unlock(&bitmap_lock);
+		spin_unlock(&sbi->bitmap_lock);
 		iput(inode);
 		return ERR_PTR(-ENOSPC);
 	}
 	if (cominix_test_and_set_bit(j, bh->b_data)) {	/* shouldn't happen */
-		spin_unlock(&bitmap_lock);
+		spin_unlock(&sbi->bitmap_lock);
 		printk("cominix_new_inode: bit already set\n");
 		iput(inode);
 		return ERR_PTR(-ENOSPC);
 	}
-	spin_unlock(&bitmap_lock);
+	percpu_counter_dec(&sbi->s_freeinodes_counter);
+	spin_unlock(&sbi->bitmap_lock);
 	mark_buffer_dirty(bh);
 	j += i * bits_per_zone;
 	if (!j || j > sbi->s_ninodes) {
@@ -280,6 +440,8 @@ struct inode *cominix_new_inode(const struct inode *dir, umode_t mode)
 	simple_inode_init_ts(inode);
 	inode->i_blocks = 0;
 	memset(&cominix_i(inode)->u, 0, sizeof(cominix_i(inode)->u));
+	if (S_ISREG(mode))
+		switch_inode_to_extents(inode);
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 
@@ -288,9 +450,6 @@ struct inode *cominix_new_inode(const struct inode *dir, umode_t mode)
 
 unsigned long cominix_count_free_inodes(struct super_block *sb)
 {
-	struct cominix_sb_info *sbi = cominix_sb(sb);
-	u32 bits = sbi->s_ninodes + 1;
-
-	return count_free(sbi->s_imap, sb->s_blocksize, bits);
+	return percpu_counter_read_positive(&cominix_sb(sb)->s_freeinodes_counter);
 }
 
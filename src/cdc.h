@@ -1,19 +1,22 @@
 extern u64 gear_table[256];
 
-ssize_t cdc_get_chunk_size(struct file *filp, loff_t pos);
-ssize_t cdc_get_chunk_size(struct file *filp, loff_t pos)
+#define CDC_MIN_SIZE (2LL << 10)
+#define CDC_MAX_SIZE (64LL << 10)
+
+//n is how much of the file is in buf, from the start of the chunk
+ssize_t cdc_get_chunk_size(const u8 *buf, u64 n);
+ssize_t cdc_get_chunk_size(const u8 *buf, u64 n)
 {
 	u64 MaskS = 0x0003590703530000LL;
 	//u64 MaskA = 0x0003590703530000LL;
 	u64 MaskL = 0x0003590703530000LL;
-	u64 MinSize = 2LL << 10;
-	u64 MaxSize = 64LL << 10;
+	u64 MinSize = CDC_MIN_SIZE;
+	u64 MaxSize = CDC_MAX_SIZE;
 	u64 NormalSize = 8LL << 10;
 	u64 fp = 0; //fingerprint
 
 	u32 i = MinSize;
 	
-	u64 n = filp->f_inode->i_size - pos;
 	if (n <= MinSize)
 		return n;
 
@@ -24,16 +27,15 @@ ssize_t cdc_get_chunk_size(struct file *filp, loff_t pos)
 	
 	u8 b = 0;
 	
-	pos += i;
 	for (; i < NormalSize; i++) {
-		kernel_read(filp, &b, 1, &pos);
+		b = buf[i];
 		fp = (fp << 1) + gear_table[b];
 		if (!(fp & MaskS))
 			return i;
 	}
 
 	for (; i < n; i++) {
-		kernel_read(filp, &b, 1, &pos);
+		b = buf[i];
 		fp = (fp << 1) + gear_table[b];
 		if (!(fp & MaskL))
 			return i;
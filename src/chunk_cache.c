@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Chunks that show up in many files (the same header, the same library
+ * code) are kept in memory once per filesystem, keyed by where they live in
+ * the heap, instead of being read from disk again for every file.
+ *
+ * Chunk data never changes once written, so nothing here is ever stale.
+ * A chunk only gets cached the second time it misses, so streaming through
+ * a file full of unique chunks doesn't push the shared ones out. The
+ * "seen once" set is a small array of locations that just get overwritten.
+ */
+
+#include "chunk_handler.h"
+#include <linux/hash.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#define CHUNK_CACHE_BITS 10
+#define CHUNK_CACHE_SEEN_BITS 12
+#define CHUNK_CACHE_BYTES (32 << 20)
+//bigger chunks would push out too many others
+#define CHUNK_CACHE_MAX_CHUNK (1 << 20)
+
+struct chunk_cache {
+	spinlock_t lock;
+	struct hlist_head table[1 << CHUNK_CACHE_BITS];
+	struct list_head lru; //least recently used first
+	unsigned long nr;
+	u64 bytes;
+	//0 is the hashtable, never a chunk, so the zeroed array is empty
+	blockoff_t seen[1 << CHUNK_CACHE_SEEN_BITS];
+	struct shrinker *shrinker;
+};
+
+void chunk_cache_put(struct cached_chunk *cc)
+{
+	if (refcount_dec_and_test(&cc->ref))
+		kvfree(cc);
+}
+
+//called with the lock held, the caller frees what ends up on dispose
+static void chunk_cache_evict(struct chunk_cache *cache, struct cached_chunk *cc,
+			      struct list_head *dispose)
+{
+	hlist_del(&cc->hash);
+	list_del(&cc->lru);
+	cache->nr--;
+	cache->bytes -= cc->length;
+	if (refcount_dec_and_test(&cc->ref))
+		list_add(&cc->lru, dispose);
+}
+
+static void chunk_cache_dispose(struct list_head *dispose)
+{
+	struct cached_chunk *cc, *tmp;
+
+	list_for_each_entry_safe(cc, tmp, dispose, lru)
+		kvfree(cc);
+}
+
+/*
+ * Returns the chunk with a reference held, or NULL. On a miss, *admit says
+ * whether the caller should read the whole chunk and chunk_cache_insert it.
+ */
+struct cached_chunk *chunk_cache_get(struct super_block *sb, blockoff_t loc,
+				     bool *admit)
+{
+	struct chunk_cache *cache = cominix_sb(sb)->chunk_cache;
+	u32 h = hash_64(loc, CHUNK_CACHE_BITS);
+	u32 s = hash_64(loc, CHUNK_CACHE_SEEN_BITS);
+	struct cached_chunk *cc;
+
+	*admit = false;
+	if (!cache)
+		return NULL;
+	spin_lock(&cache->lock);
+	hlist_for_each_entry(cc, &cache->table[h], hash) {
+		if (cc->loc == loc) {
+			list_move_tail(&cc->lru, &cache->lru);
+			refcount_inc(&cc->ref);
+			spin_unlock(&cache->lock);
+			return cc;
+		}
+	}
+	if (cache->seen[s] == loc)
+		*admit = true;
+	else
+		cache->seen[s] = loc;
+	spin_unlock(&cache->lock);
+	return NULL;
+}
+
+//a buffer for the chunk's data, to be inserted once it's filled
+struct cached_chunk *chunk_cache_alloc(blockoff_t loc, u64 length)
+{
+	struct cached_chunk *cc;
+
+	if (length > CHUNK_CACHE_MAX_CHUNK)
+		return NULL;
+	cc = kvmalloc(struct_size(cc, data, length), GFP_NOFS | __GFP_NOWARN);
+	if (!cc)
+		return NULL;
+	INIT_HLIST_NODE(&cc->hash);
+	INIT_LIST_HEAD(&cc->lru);
+	refcount_set(&cc->ref, 1);
+	cc->loc = loc;
+	cc->length = length;
+	return cc;
+}
+
+/*
+ * Takes over the caller's reference. If another reader put the same chunk
+ * in first, this copy is just dropped.
+ */
+void chunk_cache_insert(struct super_block *sb, struct cached_chunk *cc)
+{
+	struct chunk_cache *cache = cominix_sb(sb)->chunk_cache;
+	u32 h = hash_64(cc->loc, CHUNK_CACHE_BITS);
+	struct cached_chunk *old;
+	LIST_HEAD(dispose);
+
+	spin_lock(&cache->lock);
+	hlist_for_each_entry(old, &cache->table[h], hash) {
+		if (old->loc == cc->loc) {
+			spin_unlock(&cache->lock);
+			chunk_cache_put(cc);
+			return;
+		}
+	}
+	hlist_add_head(&cc->hash, &cache->table[h]);
+	list_add_tail(&cc->lru, &cache->lru);
+	cache->nr++;
+	cache->bytes += cc->length;
+	while (cache->bytes > CHUNK_CACHE_BYTES)
+		chunk_cache_evict(cache, list_first_entry(&cache->lru,
+				  struct cached_chunk, lru), &dispose);
+	spin_unlock(&cache->lock);
+	chunk_cache_dispose(&dispose);
+}
+
+static unsigned long chunk_cache_count(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct chunk_cache *cache = shrink->private_data;
+
+	return READ_ONCE(cache->nr);
+}
+
+static unsigned long chunk_cache_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct chunk_cache *cache = shrink->private_data;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&cache->lock);
+	while (freed < sc->nr_to_scan && !list_empty(&cache->lru)) {
+		chunk_cache_evict(cache, list_first_entry(&cache->lru,
+				  struct cached_chunk, lru), &dispose);
+		freed++;
+	}
+	spin_unlock(&cache->lock);
+	chunk_cache_dispose(&dispose);
+	return freed;
+}
+
+int chunk_cache_init(struct super_block *sb)
+{
+	struct chunk_cache *cache = kvzalloc(sizeof(*cache), GFP_KERNEL);
+
+	if (!cache)
+		return -ENOMEM;
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->shrinker = shrinker_alloc(0, "cominix-chunks:%s", sb->s_id);
+	if (!cache->shrinker) {
+		kvfree(cache);
+		return -ENOMEM;
+	}
+	cache->shrinker->count_objects = chunk_cache_count;
+	cache->shrinker->scan_objects = chunk_cache_scan;
+	cache->shrinker->private_data = cache;
+	shrinker_register(cache->shrinker);
+	cominix_sb(sb)->chunk_cache = cache;
+	return 0;
+}
+
+//nobody is reading anymore, so every chunk only has the cache's reference
+void chunk_cache_exit(struct super_block *sb)
+{
+	struct chunk_cache *cache = cominix_sb(sb)->chunk_cache;
+	LIST_HEAD(dispose);
+
+	if (!cache)
+		return;
+	shrinker_free(cache->shrinker);
+	while (!list_empty(&cache->lru))
+		chunk_cache_evict(cache, list_first_entry(&cache->lru,
+				  struct cached_chunk, lru), &dispose);
+	chunk_cache_dispose(&dispose);
+	kvfree(cache);
+	cominix_sb(sb)->chunk_cache = NULL;
+}
@@ -3,6 +3,9 @@
 #include <linux/string.h>
 #include <linux/buffer_head.h>
 #include <linux/sched.h>
+#include <linux/bio.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
 
 /* TO CONSIDER
 - i can add a hashtable lookup function that only looks up the literal array
@@ -10,8 +13,6 @@
 	since that code is common in a few places.
 */
 
-static DEFINE_MUTEX(brk_lock);
-static DEFINE_MUTEX(chunk_edge_write_lock);
 
 static block_t block_no(struct super_block *sb, blockoff_t off)
 {
@@ -40,38 +41,217 @@ static void update_brk_on_disk(struct super_block *sb, ssize_t new_brk)
 	brelse(bh);
 }
 
-static blockoff_t chunk_alloc(struct super_block *sb, ssize_t size)
+/*
+ * The table gets a slot for every block that's left after it. An inline
+ * heap has no table, its chunks start right after the hashtable.
+ */
+void chunk_layout_init(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	u64 bs = sb->s_blocksize;
+
+	BUILD_BUG_ON(sizeof(struct chunk_head) > CHUNK_HEAD_SLOT);
+	sbi->headers = sbi->hashtable + sbi->hashtable_size;
+	if (sbi->chunk_layout == CHUNK_LAYOUT_INLINE) {
+		sbi->heap_start = sbi->headers;
+		return;
+	}
+	u64 nr_blocks = div64_u64(sbi->max_brk - sbi->headers - bs, bs + CHUNK_HEAD_SLOT);
+	sbi->heap_start = round_up(sbi->headers + nr_blocks * CHUNK_HEAD_SLOT, bs);
+	//rounding up can cost the last block its slot
+	sbi->max_brk = min(sbi->max_brk, sbi->heap_start + nr_blocks * bs);
+	printk("chunk heads at %lld kb, chunk data from %lld kb\n",
+	       sbi->headers >> 10, sbi->heap_start >> 10);
+}
+
+static bool heap_is_inline(struct super_block *sb)
+{
+	return cominix_sb(sb)->chunk_layout == CHUNK_LAYOUT_INLINE;
+}
+
+//an inline chunk's location is its head
+static blockoff_t head_off(struct super_block *sb, blockoff_t chunk)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	if (heap_is_inline(sb))
+		return chunk;
+	BUG_ON(chunk < sbi->heap_start || inblock_offset(sb, chunk));
+	return sbi->headers + block_no(sb, chunk - sbi->heap_start) * CHUNK_HEAD_SLOT;
+}
+
+static blockoff_t chunk_data(struct super_block *sb, blockoff_t chunk)
+{
+	if (heap_is_inline(sb))
+		return chunk + sizeof(struct chunk_head);
+	return chunk;
+}
+
+//where the next chunk of a run is
+static blockoff_t run_next(struct super_block *sb, blockoff_t chunk, u32 length)
+{
+	if (heap_is_inline(sb))
+		return chunk_data(sb, chunk) + length;
+	return chunk_data_end(sb, chunk, length);
+}
+
+//0 if the heap doesn't have size bytes left
+static blockoff_t chunk_try_alloc(struct super_block *sb, ssize_t size)
 {
 	BUG_ON(size <= 0);
-	mutex_lock(&brk_lock);
+	mutex_lock(&cominix_sb(sb)->brk_lock);
 
 	blockoff_t *brk = &cominix_sb(sb)->heap_brk;
 	u8 log = sb->s_blocksize_bits;
 
 	//it's fine that that we don't release the lock
 	//because brk is in an invalid state anyway
-	BUG_ON(*brk <= cominix_sb(sb)->s_nzones << log);
+	BUG_ON(*brk < cominix_sb(sb)->heap_start);
+	BUG_ON(inblock_offset(sb, *brk));
 
-	//so the chunk metadata doesnt straddle a boundary
-	if (block_no(sb, *brk) != block_no(sb, *brk + sizeof(struct chunk_head) - 1))
-		*brk = (block_no(sb, *brk) + 1) << log;
 	blockoff_t new = *brk;
-	*brk += sizeof(struct chunk_head) + size;
 	
 	//printk("break increased by %lld kb, is now at %lld mb %lld kb\n", size >> 10, *brk >> 20, (*brk >> 10) & ((1<<10)-1));
 	blockoff_t max_brk = cominix_sb(sb)->max_brk;
 	//printk("max break is %lld mb %lld kb\n", max_brk >> 20, (max_brk >> 10) & ((1<<10)-1));
-	if (*brk >= max_brk) {
+	if (chunk_data_end(sb, new, size) >= max_brk) {
+		mutex_unlock(&cominix_sb(sb)->brk_lock);
+		return 0;
+	}
+	*brk = chunk_data_end(sb, new, size);
+
+	//under the lock so an older brk never lands on top of a newer one
+	update_brk_on_disk(sb, *brk);
+	mutex_unlock(&cominix_sb(sb)->brk_lock);
+
+	return new;
+}
+
+static blockoff_t chunk_alloc(struct super_block *sb, ssize_t size)
+{
+	blockoff_t new = chunk_try_alloc(sb, size);
+
+	if (!new) {
 		printk("Heap ran out of space. Giving up.\n");
 		BUG();
 	}
+	return new;
+}
+
+/*
+ * Tails that chunkers gave back in the middle of the heap are kept for the
+ * next one. Called with brk_lock held. When there's no room the smallest
+ * is forgotten, which only wastes it like before.
+ */
+static void keep_free_tail(struct cominix_sb_info *sbi, blockoff_t start, blockoff_t end)
+{
+	int i = sbi->nr_heap_tails;
+
+	if (i == HEAP_FREE_TAILS) {
+		int smallest = 0;
+		for (int t = 1; t < HEAP_FREE_TAILS; t++) {
+			if (sbi->heap_tails[t].end - sbi->heap_tails[t].start <
+			    sbi->heap_tails[smallest].end - sbi->heap_tails[smallest].start)
+				smallest = t;
+		}
+		if (sbi->heap_tails[smallest].end - sbi->heap_tails[smallest].start >= end - start)
+			return;
+		i = smallest;
+	} else {
+		sbi->nr_heap_tails++;
+	}
+	sbi->heap_tails[i].start = start;
+	sbi->heap_tails[i].end = end;
+}
 
-	mutex_unlock(&brk_lock);
+static void drop_free_tail(struct cominix_sb_info *sbi, int i)
+{
+	sbi->heap_tails[i] = sbi->heap_tails[--sbi->nr_heap_tails];
+}
 
-	update_brk_on_disk(sb, *brk);
+//the start of up to *want bytes from a free tail, 0 if none has need
+static blockoff_t take_free_tail(struct super_block *sb, u64 need, u64 *want)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	blockoff_t new = 0;
+
+	mutex_lock(&sbi->brk_lock);
+	for (int i = 0; i < sbi->nr_heap_tails; i++) {
+		u64 len = sbi->heap_tails[i].end - sbi->heap_tails[i].start;
+		if (len < need)
+			continue;
+		new = sbi->heap_tails[i].start;
+		*want = min(*want, len);
+		sbi->heap_tails[i].start += *want;
+		if (sbi->heap_tails[i].start == sbi->heap_tails[i].end)
+			drop_free_tail(sbi, i);
+		break;
+	}
+	mutex_unlock(&sbi->brk_lock);
+	return new;
+}
+
+/*
+ * A chunker takes the heap a big piece at a time and hands it out to its
+ * own chunks, so the chunks of one file end up next to each other (and in
+ * runs) even when other files are being chunked at the same time. The
+ * piece is no bigger than what's left of the file, so small files don't
+ * each take a whole HEAP_EXTENT_SIZE.
+ */
+static blockoff_t extent_alloc(struct super_block *sb, struct heap_extent *ext, ssize_t size)
+{
+	u64 need = round_up(size, sb->s_blocksize);
+	blockoff_t new;
+
+	if (!ext)
+		return chunk_alloc(sb, size);
+	if (ext->next + need > ext->end) {
+		u64 want = min_t(u64, HEAP_EXTENT_SIZE, round_up(ext->left, sb->s_blocksize));
+		want = max(want, need);
+		chunk_extent_release(sb, ext);
+		ext->next = take_free_tail(sb, need, &want);
+		if (!ext->next)
+			ext->next = chunk_try_alloc(sb, want);
+		if (!ext->next) {
+			//not a whole extent left, the chunk may still fit
+			want = need;
+			ext->next = chunk_alloc(sb, want);
+		}
+		ext->end = chunk_data_end(sb, ext->next, want);
+	}
+	new = ext->next;
+	ext->next += need;
 	return new;
 }
 
+/*
+ * Gives back what's left of the extent. At the end of the heap brk just
+ * goes down (and past any kept tails it reaches), anywhere else the tail
+ * is kept for the next chunker.
+ */
+void chunk_extent_release(struct super_block *sb, struct heap_extent *ext)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+
+	if (ext->next == ext->end)
+		return;
+	mutex_lock(&sbi->brk_lock);
+	if (sbi->heap_brk == ext->end) {
+		sbi->heap_brk = ext->next;
+		for (int i = 0; i < sbi->nr_heap_tails; i++) {
+			if (sbi->heap_tails[i].end != sbi->heap_brk)
+				continue;
+			sbi->heap_brk = sbi->heap_tails[i].start;
+			drop_free_tail(sbi, i);
+			i = -1; //the one moved into i might be next
+		}
+		update_brk_on_disk(sb, sbi->heap_brk);
+	} else {
+		keep_free_tail(sbi, ext->next, ext->end);
+	}
+	mutex_unlock(&sbi->brk_lock);
+	ext->next = ext->end = 0;
+}
+
 void *load_blockoff(struct super_block *sb, blockoff_t off, ssize_t *bytes_left, struct buffer_head **bh)
 {
 	BUG_ON(!off);
@@ -94,9 +274,23 @@ static u64 hashtable_hash(struct super_block *sb, u64 chunk_hash)
 }
 
 blockoff_t chunk_search_hashtable(struct super_block *sb, u64 chunk_hash)
+{
+	return chunk_search_hashtable_flags(sb, chunk_hash, 0);
+}
+
+/*
+ * Each bucket is guarded by one of a fixed set of mutexes, so chunkers only
+ * wait for each other when they hit buckets that share a lock. Searching
+ * and adding happen under the same lock so a chunk is never added twice.
+ */
+static struct mutex *bucket_lock(struct super_block *sb, u64 index)
+{
+	return &cominix_sb(sb)->bucket_locks[index % CHUNK_BUCKET_LOCKS];
+}
+
+static blockoff_t search_bucket(struct super_block *sb, u64 index, u64 chunk_hash, u16 flags)
 {
 	struct cominix_sb_info *msi = cominix_sb(sb);
-	u64 index = hashtable_hash(sb, chunk_hash);	
 	blockoff_t off = msi->hashtable + index*sizeof(blockoff_t);
 	ssize_t bytes_left = 0;
 	struct buffer_head *bh = NULL;
@@ -110,9 +304,9 @@ blockoff_t chunk_search_hashtable(struct super_block *sb, u64 chunk_hash)
 	brelse(bh);
 	while (chunk_location) {
 		printk("INSPECTING CHUNK %llx", chunk_location);
-		struct chunk *chunk = load_blockoff(sb, chunk_location, &bytes_left, &bh);
+		struct chunk_head *chunk = load_blockoff(sb, head_off(sb, chunk_location), &bytes_left, &bh);
 		//i can check length here as well if i'd like
-		if (chunk->hash == chunk_hash) {
+		if (chunk->hash == chunk_hash && chunk->flags == flags) {
 			brelse(bh);
 			return chunk_location;
 		}
@@ -123,6 +317,17 @@ blockoff_t chunk_search_hashtable(struct super_block *sb, u64 chunk_hash)
 	return 0;
 }
 
+blockoff_t chunk_search_hashtable_flags(struct super_block *sb, u64 chunk_hash, u16 flags)
+{
+	u64 index = hashtable_hash(sb, chunk_hash);
+	blockoff_t found;
+
+	mutex_lock(bucket_lock(sb, index));
+	found = search_bucket(sb, index, chunk_hash, flags);
+	mutex_unlock(bucket_lock(sb, index));
+	return found;
+}
+
 //releases *bh and replaces it with the next block
 static inline char *get_next_block(struct super_block *sb, struct buffer_head **bh, int dirty)
 {
@@ -138,8 +343,14 @@ static inline char *get_next_block(struct super_block *sb, struct buffer_head **
 	return (*bh)->b_data;
 }
 
-//if data null then fill with zeroes
-static int write_data_storage(struct super_block *sb, blockoff_t storage, char *data, ssize_t length)
+/*
+ * If data null then fill with zeroes.
+ *
+ * There's no lock around the copies: a partial block is the tail of one
+ * chunk's data, a head slot, or a hashtable word, and each of those only
+ * has one writer (the owner of the chunk, or whoever holds the bucket).
+ */
+static int write_data_storage_bh(struct super_block *sb, blockoff_t storage, char *data, ssize_t length)
 {
 	ssize_t remaining = length;
 	ssize_t bytes_left = 0;
@@ -148,25 +359,19 @@ static int write_data_storage(struct super_block *sb, blockoff_t storage, char *
 
 	char *cursor = data;
 	ssize_t to_write = min(bytes_left, remaining);
-	mutex_lock(&chunk_edge_write_lock);
 	if (data) 
 		memcpy(first_block, cursor, to_write);
 	else
 		memset(first_block, 0, to_write);
-	mutex_unlock(&chunk_edge_write_lock);
 	remaining -= to_write;
 	cursor += to_write;
 	while(remaining > 0) {	
 		char *next_block = get_next_block(sb, &bh, 1); //dirty
 		to_write = min((ssize_t)sb->s_blocksize, remaining);
-		if (to_write < sb->s_blocksize)
-			mutex_lock(&chunk_edge_write_lock);
 		if (data)
 			memcpy(next_block, cursor, to_write);
 		else
 			memset(next_block, 0, to_write);
-		if (to_write < sb->s_blocksize)
-			mutex_unlock(&chunk_edge_write_lock);
 		remaining -= to_write;
 		cursor += to_write;
 	}
@@ -175,84 +380,843 @@ static int write_data_storage(struct super_block *sb, blockoff_t storage, char *
 	return 0;
 }
 
-static int read_data_storage(struct super_block *sb, blockoff_t storage, char __user *data, ssize_t length)
+//returns how much was copied, which is less than length if the user buffer faulted
+static ssize_t read_data_storage_bh(struct super_block *sb, blockoff_t storage, struct iov_iter *to, ssize_t length)
 {
-	BUG_ON(!data);
 	ssize_t remaining = length;
 	ssize_t bytes_left = 0;
 	struct buffer_head *bh = NULL;
 	char *first_block = load_blockoff(sb, storage, &bytes_left, &bh);
 
-	char __user *cursor = data;
 	ssize_t to_read = min(bytes_left, remaining);
-	int ret = copy_to_user(cursor, first_block, to_read);
-	BUG_ON(ret);
-	remaining -= to_read;
-	cursor += to_read;
-	while(remaining > 0) {	
+	ssize_t copied = copy_to_iter(first_block, to_read, to);
+	remaining -= copied;
+	while(remaining > 0 && copied == to_read) {	
 		char *next_block = get_next_block(sb, &bh, 0); //not dirty
 		to_read = min((ssize_t)sb->s_blocksize, remaining);
-		int ret = copy_to_user(cursor, next_block, to_read);
-		if (ret) {
-			printk("bytes not transferred =  %d", ret);
-			BUG_ON(ret);
-		}
-		remaining -= to_read;
-		cursor += to_read;
+		copied = copy_to_iter(next_block, to_read, to);
+		remaining -= copied;
+	}
+	brelse(bh);
+	return length - remaining;
+}
+
+/*
+ * Chunk data goes straight to the disk with a bio instead of a sb_bread per
+ * block, and its last block is padded with zeroes and written the same
+ * way. So no chunk data ever sits dirty in the buffer cache, where a bio
+ * reading a whole run wouldn't see it.
+ *
+ * Reads still take the partial blocks at the ends through the buffer
+ * cache, which is fine since those blocks are only read once they're on
+ * the disk (chunk_wait_writes).
+ */
+static void bio_add_buf(struct bio *bio, char *buf, ssize_t len)
+{
+	while (len > 0) {
+		unsigned int off = offset_in_page(buf);
+		unsigned int n = min_t(ssize_t, len, PAGE_SIZE - off);
+		struct page *page = is_vmalloc_addr(buf) ?
+			vmalloc_to_page(buf) : virt_to_page(buf);
+		__bio_add_page(bio, page, n, off);
+		buf += n;
+		len -= n;
+	}
+}
+
+//the most one bio takes, the buffer doesn't have to start on a page
+#define HEAP_BIO_MAX ((ssize_t)(BIO_MAX_VECS - 1) * PAGE_SIZE)
+
+static struct bio *heap_bio_alloc(struct super_block *sb, blockoff_t storage,
+				  ssize_t len, blk_opf_t opf)
+{
+	unsigned short nr_vecs = min_t(ssize_t, DIV_ROUND_UP(len, PAGE_SIZE) + 1,
+				       BIO_MAX_VECS);
+	struct bio *bio = bio_alloc(sb->s_bdev, nr_vecs, opf, GFP_NOFS);
+
+	BUG_ON(len > HEAP_BIO_MAX);
+	bio->bi_iter.bi_sector = sector_no(sb, storage);
+	return bio;
+}
+
+/*
+ * A chunk data bio. They're numbered as they're sent, so a chunker only
+ * waits for the ones sent before its last chunk and not for everyone
+ * else's that come after.
+ */
+struct heap_write {
+	struct super_block *sb;
+	blockoff_t chunk;
+	u64 seq;
+	struct list_head list; //in sbi->heap_writes
+	struct llist_node failed;
+	char *copy;
+};
+
+static void heap_write_end_io(struct bio *bio)
+{
+	struct heap_write *hw = bio->bi_private;
+	struct cominix_sb_info *sbi = cominix_sb(hw->sb);
+	unsigned long flags;
+	bool oldest;
+
+	kfree(hw->copy);
+	spin_lock_irqsave(&sbi->heap_write_lock, flags);
+	oldest = list_is_first(&hw->list, &sbi->heap_writes);
+	list_del(&hw->list);
+	spin_unlock_irqrestore(&sbi->heap_write_lock, flags);
+	if (bio->bi_status) {
+		//the chunk is already in the hashtable, the next waiter poisons it.
+		//added before the error is set so whoever sees the error sees this too
+		llist_add(&hw->failed, &sbi->heap_failed_writes);
+		errseq_set(&sbi->heap_write_err, -EIO);
+	} else {
+		kfree(hw);
+	}
+	bio_put(bio);
+	if (oldest)
+		wake_up(&sbi->heap_write_wq);
+}
+
+/*
+ * No memory for a padded copy: the whole blocks are written from the
+ * caller's buffer and the last one through the buffer cache, both waited
+ * for so nothing is left dirty.
+ */
+static int write_blocks_sync(struct super_block *sb, blockoff_t storage, char *data, ssize_t length)
+{
+	ssize_t whole = round_down(length, sb->s_blocksize);
+	struct buffer_head *bh;
+	int err = 0;
+
+	if (whole) {
+		struct bio *bio = heap_bio_alloc(sb, storage, whole, REQ_OP_WRITE);
+		bio_add_buf(bio, data, whole);
+		err = submit_bio_wait(bio);
+		bio_put(bio);
 	}
+	if (err || length == whole)
+		return err;
+	bh = sb_getblk(sb, block_no(sb, storage + whole));
+	lock_buffer(bh);
+	memcpy(bh->b_data, data + whole, length - whole);
+	memset(bh->b_data + length - whole, 0, sb->s_blocksize - (length - whole));
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	err = sync_dirty_buffer(bh);
 	brelse(bh);
+	return err;
+}
+
+//the caller's buffer can be reused once this returns
+static int write_blocks_bio(struct super_block *sb, blockoff_t storage, char *data, ssize_t length)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	ssize_t padded = round_up(length, sb->s_blocksize);
+	struct heap_write *hw = kmalloc(sizeof(*hw), GFP_NOFS);
+	struct bio *bio;
+
+	if (!hw)
+		return write_blocks_sync(sb, storage, data, length);
+	hw->copy = kmalloc(padded, GFP_NOFS | __GFP_NOWARN);
+	if (!hw->copy) {
+		kfree(hw);
+		return write_blocks_sync(sb, storage, data, length);
+	}
+	memcpy(hw->copy, data, length);
+	memset(hw->copy + length, 0, padded - length);
+	hw->sb = sb;
+	hw->chunk = storage;
+
+	bio = heap_bio_alloc(sb, storage, padded, REQ_OP_WRITE);
+	bio->bi_private = hw;
+	bio->bi_end_io = heap_write_end_io;
+	bio_add_buf(bio, hw->copy, padded);
+	spin_lock_irq(&sbi->heap_write_lock);
+	hw->seq = ++sbi->heap_write_seq;
+	list_add_tail(&hw->list, &sbi->heap_writes);
+	spin_unlock_irq(&sbi->heap_write_lock);
+	submit_bio(bio);
 	return 0;
 }
 
-static int copy_chunk_into_storage(struct super_block *sb, blockoff_t storage, struct chunk *metadata, char *data)
+//splits [storage, storage + length) into the partial blocks at each end and the whole ones
+static void split_edges(struct super_block *sb, blockoff_t storage, ssize_t length,
+			ssize_t *head, ssize_t *whole)
 {
-	write_data_storage(sb, storage, (char*)metadata, sizeof(struct chunk_head));
-	storage += sizeof(struct chunk_head);
-	write_data_storage(sb, storage, data, metadata->length);
+	u64 in_block = inblock_offset(sb, storage);
+	*head = in_block ? min_t(ssize_t, length, sb->s_blocksize - in_block) : 0;
+	*whole = (length - *head) & ~((ssize_t)sb->s_blocksize - 1);
+}
+
+/*
+ * Writes for a chunker are only queued, chunk_wait_writes has to be called
+ * before anything reads the data back. Without one nobody would wait, so
+ * the write is done here. Chunk data starts on a block boundary and has
+ * its last block to itself.
+ */
+static int write_data_storage(struct super_block *sb, blockoff_t storage, char *data,
+			      ssize_t length, struct heap_extent *ext)
+{
+	//the hashtable is read through the buffer cache
+	if (!data)
+		return write_data_storage_bh(sb, storage, data, length);
+	BUG_ON(inblock_offset(sb, storage));
+	if (!ext)
+		return write_blocks_sync(sb, storage, data, length);
+	return write_blocks_bio(sb, storage, data, length);
+}
+
+//the seq of the oldest write still in flight, U64_MAX if there's none
+static u64 oldest_heap_write(struct cominix_sb_info *sbi)
+{
+	struct heap_write *hw;
+	u64 seq;
+
+	spin_lock_irq(&sbi->heap_write_lock);
+	hw = list_first_entry_or_null(&sbi->heap_writes, struct heap_write, list);
+	seq = hw ? hw->seq : U64_MAX;
+	spin_unlock_irq(&sbi->heap_write_lock);
+	return seq;
+}
+
+/*
+ * Reads are split in two so several can be in flight at once: start sends
+ * the bio for the whole blocks (and readahead for the edges), finish waits
+ * for it and copies everything out in order.
+ */
+struct heap_read {
+	blockoff_t storage;
+	ssize_t length;
+	ssize_t head;
+	ssize_t whole;
+	char *buf; //the whole blocks, NULL if it all goes through the buffer cache
+	atomic_t pending; //bios still in flight
+	struct completion done;
+	blk_status_t status;
+};
+
+static void heap_read_end_io(struct bio *bio)
+{
+	struct heap_read *rd = bio->bi_private;
+
+	if (bio->bi_status)
+		WRITE_ONCE(rd->status, bio->bi_status);
+	bio_put(bio);
+	if (atomic_dec_and_test(&rd->pending))
+		complete(&rd->done);
+}
+
+static void heap_read_start(struct super_block *sb, struct heap_read *rd,
+			    blockoff_t storage, ssize_t length)
+{
+	rd->storage = storage;
+	rd->length = length;
+	rd->buf = NULL;
+	rd->status = BLK_STS_OK;
+	split_edges(sb, storage, length, &rd->head, &rd->whole);
+	if (rd->head)
+		sb_breadahead(sb, block_no(sb, storage));
+	if (length - rd->head - rd->whole)
+		sb_breadahead(sb, block_no(sb, storage + length - 1));
+	if (!rd->whole)
+		return;
+	rd->buf = kvmalloc(rd->whole, GFP_NOFS | __GFP_NOWARN);
+	if (!rd->buf)
+		return;
+
+	init_completion(&rd->done);
+	//held until every bio is sent, so done can't complete early
+	atomic_set(&rd->pending, 1);
+	for (ssize_t off = 0; off < rd->whole; off += HEAP_BIO_MAX) {
+		ssize_t n = min(rd->whole - off, HEAP_BIO_MAX);
+		struct bio *bio = heap_bio_alloc(sb, storage + rd->head + off, n,
+						 REQ_OP_READ);
+		bio->bi_private = rd;
+		bio->bi_end_io = heap_read_end_io;
+		bio_add_buf(bio, rd->buf + off, n);
+		atomic_inc(&rd->pending);
+		submit_bio(bio);
+	}
+	if (atomic_dec_and_test(&rd->pending))
+		complete(&rd->done);
+}
+
+static void heap_read_wait(struct heap_read *rd)
+{
+	wait_for_completion(&rd->done);
+	if (is_vmalloc_addr(rd->buf))
+		invalidate_kernel_vmap_range(rd->buf, rd->whole);
+}
+
+//for reads that were started but won't be finished
+static void heap_read_cancel(struct heap_read *rd)
+{
+	if (!rd->buf)
+		return;
+	wait_for_completion(&rd->done);
+	kvfree(rd->buf);
+}
+
+//returns how much was copied, which is less than length if the user buffer faulted
+static ssize_t heap_read_finish(struct super_block *sb, struct heap_read *rd, struct iov_iter *to)
+{
+	ssize_t copied, done = 0;
+
+	if (!rd->buf)
+		return read_data_storage_bh(sb, rd->storage, to, rd->length);
+	if (rd->head) {
+		done = read_data_storage_bh(sb, rd->storage, to, rd->head);
+		if (done != rd->head)
+			goto out;
+	}
+	heap_read_wait(rd);
+	if (rd->status) {
+		printk("UNABLE TO READ %ld bytes at %llx\n", rd->whole, rd->storage + rd->head);
+		kvfree(rd->buf);
+		return done;
+	}
+	copied = copy_to_iter(rd->buf, rd->whole, to);
+	done += copied;
+	if (copied == rd->whole && rd->length - done)
+		done += read_data_storage_bh(sb, rd->storage + done, to, rd->length - done);
+	kvfree(rd->buf);
+	return done;
+out:
+	heap_read_cancel(rd);
+	return done;
+}
+
+//-EIO if the disk failed before anything was copied, -EFAULT if the user buffer did
+static ssize_t read_data_storage(struct super_block *sb, blockoff_t storage, struct iov_iter *to, ssize_t length)
+{
+	struct heap_read rd;
+	ssize_t done;
+
+	heap_read_start(sb, &rd, storage, length);
+	done = heap_read_finish(sb, &rd, to);
+	if (!done && length)
+		return rd.status ? -EIO : -EFAULT;
+	return done;
+}
+
+//reads the start of a chunk's data into a kernel buffer
+int chunk_read_data(struct super_block *sb, blockoff_t chunk, void *buf, ssize_t length)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = length };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, ITER_DEST, &kv, 1, length);
+	if (read_data_storage(sb, chunk_data(sb, chunk), &iter, length) != length)
+		return -EIO;
 	return 0;
 }
 
+static int copy_chunk_into_storage(struct super_block *sb, blockoff_t storage, struct chunk *metadata,
+				   char *data, struct heap_extent *ext)
+{
+	write_data_storage_bh(sb, head_off(sb, storage), (char*)metadata, sizeof(struct chunk_head));
+	//a fingerprint is read right after it's found, so it can't wait for a bio
+	if (metadata->flags & CHUNK_FLAG_FILE)
+		return write_data_storage_bh(sb, storage, data, metadata->length);
+	return write_data_storage(sb, storage, data, metadata->length, ext);
+}
+
 //really this should be in the mkfs utility
 int chunk_reset_hashtable(struct super_block *sb)
 {
 	struct cominix_sb_info *msi = cominix_sb(sb);
-	msi->heap_brk = msi->hashtable + msi->hashtable_size;
+	msi->heap_brk = msi->heap_start;
 	printk("HASHTABLE IS %lld kb\nAND SIZE IS %lld kb\n", msi->hashtable / 1024, msi->hashtable_size / 1024);
 	//zeroes out the hashtable
-	return write_data_storage(sb, msi->hashtable, NULL, msi->hashtable_size);
+	return write_data_storage(sb, msi->hashtable, NULL, msi->hashtable_size, NULL);
 }
 
-//has been searched beforehand so we know it isn't part of the table
-blockoff_t chunk_fill_hashtable(struct super_block *sb, struct chunk *metadata, char *data)
+//called with the bucket's lock held
+static blockoff_t fill_bucket(struct super_block *sb, u64 index, struct chunk *metadata,
+			      char *data, struct heap_extent *ext)
 {
 	struct cominix_sb_info *msi = cominix_sb(sb);
-	blockoff_t fresh_chunk = chunk_alloc(sb, metadata->length);
-	u64 index = hashtable_hash(sb, metadata->hash);
+	blockoff_t fresh_chunk = extent_alloc(sb, ext, metadata->length);
 	blockoff_t off = msi->hashtable + index*sizeof(blockoff_t);
 	ssize_t bytes_left = 0;
 	struct buffer_head *bh = NULL;
 
 	blockoff_t *hash_table_entry = load_blockoff(sb, off, &bytes_left, &bh);
 	metadata->next = *hash_table_entry;
+	//the head has to be there before anyone can find the chunk
+	if (copy_chunk_into_storage(sb, fresh_chunk, metadata, data, ext)) {
+		//never linked, so nobody finds it. The chunker gives up on the error
+		errseq_set(&msi->heap_write_err, -EIO);
+		brelse(bh);
+		return fresh_chunk;
+	}
 	*hash_table_entry = fresh_chunk;
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
-	copy_chunk_into_storage(sb, fresh_chunk, metadata, data);
-	
 	return fresh_chunk;
 }
 
+//has been searched beforehand so we know it isn't part of the table
+blockoff_t chunk_fill_hashtable(struct super_block *sb, struct chunk *metadata, char *data)
+{
+	u64 index = hashtable_hash(sb, metadata->hash);
+	blockoff_t fresh_chunk;
+
+	mutex_lock(bucket_lock(sb, index));
+	fresh_chunk = fill_bucket(sb, index, metadata, data, NULL);
+	mutex_unlock(bucket_lock(sb, index));
+	return fresh_chunk;
+}
+
+/*
+ * A chunk whose data never made it to the disk keeps its place in the
+ * bucket (the heap only grows) but its head can't match anything anymore.
+ */
+static void poison_chunk(struct super_block *sb, blockoff_t chunk)
+{
+	ssize_t bytes_left;
+	struct buffer_head *bh;
+	struct chunk_head *head = load_blockoff(sb, head_off(sb, chunk), &bytes_left, &bh);
+	u64 index = hashtable_hash(sb, head->hash);
+
+	brelse(bh);
+	mutex_lock(bucket_lock(sb, index));
+	head = load_blockoff(sb, head_off(sb, chunk), &bytes_left, &bh);
+	head->flags |= CHUNK_FLAG_BAD;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	mutex_unlock(bucket_lock(sb, index));
+	printk("CMINIX: couldn't write the chunk at %lld kb, it won't be used.\n", chunk >> 10);
+}
+
+//called without any bucket lock
+static void poison_failed_writes(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	struct llist_node *failed;
+	struct heap_write *hw, *tmp;
+
+	if (llist_empty(&sbi->heap_failed_writes))
+		return;
+	failed = llist_del_all(&sbi->heap_failed_writes);
+	llist_for_each_entry_safe(hw, tmp, failed, failed) {
+		poison_chunk(sb, hw->chunk);
+		kfree(hw);
+	}
+}
+
+//the location of the chunk with this hash, adding it if it's not there yet
+blockoff_t chunk_find_or_fill(struct super_block *sb, struct chunk *metadata,
+			      char *data, struct heap_extent *ext, bool *added)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	u64 index = hashtable_hash(sb, metadata->hash);
+	blockoff_t location;
+
+	//so a chunk that failed before we started isn't found
+	poison_failed_writes(sb);
+	mutex_lock(bucket_lock(sb, index));
+	location = search_bucket(sb, index, metadata->hash, metadata->flags);
+	*added = !location;
+	if (!location)
+		location = fill_bucket(sb, index, metadata, data, ext);
+	//a chunk that was found may still be on its way to the disk too
+	if (ext) {
+		spin_lock_irq(&sbi->heap_write_lock);
+		ext->write_seq = sbi->heap_write_seq;
+		spin_unlock_irq(&sbi->heap_write_lock);
+	}
+	mutex_unlock(bucket_lock(sb, index));
+	return location;
+}
+
+void chunk_extent_start(struct super_block *sb, struct heap_extent *ext)
+{
+	ext->next = ext->end = 0;
+	ext->write_seq = 0;
+	ext->write_err = errseq_sample(&cominix_sb(sb)->heap_write_err);
+}
+
+/*
+ * Waits for the chunker's own writes and those of the chunks it found,
+ * then says if any heap write failed since it started. That's more than
+ * its own, but it can't tell which chunks another chunker's error was for
+ * until they're poisoned.
+ */
+int chunk_wait_writes(struct super_block *sb, struct heap_extent *ext)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+
+	wait_event(sbi->heap_write_wq, oldest_heap_write(sbi) > ext->write_seq);
+	poison_failed_writes(sb);
+	return errseq_check_and_advance(&sbi->heap_write_err, &ext->write_err);
+}
+
+//for unmount, everything that's in flight
+void chunk_wait_all_writes(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+
+	wait_event(sbi->heap_write_wq, oldest_heap_write(sbi) == U64_MAX);
+	poison_failed_writes(sb);
+}
+
 int chunk_copy_into_buffer(struct super_block *sb, 
 	struct chunk_entry *chunk, 
-	char __user *buf, ssize_t count, off_t pos)
+	struct iov_iter *to, ssize_t count, off_t pos)
 {
 	//printk("CHUNK SIZE IS %lld kb (and %lld bytes)", chunk->size >> 10, chunk->size & ((1<<10) - 1));
 	ssize_t to_read = min(count, (ssize_t)chunk->size - (ssize_t)pos);
 	if (to_read <= 0)
 		return 0;
-	blockoff_t loc = chunk->location + sizeof(struct chunk_head) + pos;
-	read_data_storage(sb, loc, buf, to_read);
-	return to_read;
+	return chunk_read_batch(sb, chunk, 1, pos, to, to_read);
+}
+
+/*
+ * The chunks of a run are only block aligned, not packed, so a run is read
+ * as one piece of disk and then the data is picked out from between the
+ * padding (or the heads, on an inline heap). The heads say where each chunk
+ * ends.
+ */
+struct run_read {
+	blockoff_t phys_start;
+	ssize_t phys_len;
+	int nr;
+	struct {
+		blockoff_t loc; //of the data
+		u64 start; //where it starts in the run
+		u32 len;
+	} members[CHUNK_RUN_MAX];
+	char *buf;
+};
+
+static u32 chunk_data_length(struct super_block *sb, blockoff_t chunk)
+{
+	ssize_t bytes_left;
+	struct buffer_head *bh;
+	struct chunk_head *head = load_blockoff(sb, head_off(sb, chunk), &bytes_left, &bh);
+	u32 length = head->length;
+	brelse(bh);
+	return length;
+}
+
+//finds the chunks of the run that [pos, pos + len) touches
+static struct run_read *run_prepare(struct super_block *sb, struct chunk_entry *chunk,
+				    off_t pos, ssize_t len)
+{
+	struct run_read *rr = kmalloc(sizeof(*rr), GFP_NOFS);
+	blockoff_t loc = chunk_loc(chunk);
+	u64 start = 0;
+
+	if (!rr)
+		return NULL;
+	rr->nr = 0;
+	for (int m = 0; m < chunk_run_members(chunk) && start < pos + len; m++) {
+		u32 length = chunk_data_length(sb, loc);
+		if (start + length > pos) {
+			rr->members[rr->nr].loc = chunk_data(sb, loc);
+			rr->members[rr->nr].start = start;
+			rr->members[rr->nr].len = length;
+			rr->nr++;
+		}
+		start += length;
+		loc = run_next(sb, loc, length);
+	}
+	if (WARN_ON(!rr->nr)) {
+		kfree(rr);
+		return NULL;
+	}
+	rr->phys_start = rr->members[0].loc + (pos - rr->members[0].start);
+	int last = rr->nr - 1;
+	blockoff_t phys_end = rr->members[last].loc +
+		min_t(u64, rr->members[last].len, pos + len - rr->members[last].start);
+	rr->phys_len = phys_end - rr->phys_start;
+	rr->buf = kvmalloc(rr->phys_len, GFP_NOFS);
+	if (!rr->buf) {
+		kfree(rr);
+		return NULL;
+	}
+	return rr;
+}
+
+static void run_free(struct run_read *rr)
+{
+	if (!rr)
+		return;
+	kvfree(rr->buf);
+	kfree(rr);
+}
+
+static ssize_t run_copy_out(struct run_read *rr, off_t pos, ssize_t len,
+			    struct iov_iter *to)
+{
+	ssize_t done = 0;
+
+	for (int m = 0; m < rr->nr; m++) {
+		u64 from = max_t(u64, pos, rr->members[m].start);
+		u64 end = min_t(u64, pos + len, rr->members[m].start + rr->members[m].len);
+		char *data = rr->buf + rr->members[m].loc - rr->phys_start
+			+ (from - rr->members[m].start);
+		ssize_t copied = copy_to_iter(data, end - from, to);
+		done += copied;
+		if (copied != end - from)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Like chunk_copy_into_buffer but for several chunks in a row, which can be
+ * all over the heap. start sends everything to the disk, finish waits for
+ * the chunks in order and copies them out. Readahead does the two in
+ * different threads.
+ */
+struct chunk_batch {
+	int nr;
+	struct chunk_entry chunks[CHUNK_READ_BATCH];
+	off_t offs[CHUNK_READ_BATCH];
+	ssize_t lens[CHUNK_READ_BATCH];
+	struct run_read *runs[CHUNK_READ_BATCH]; //for runs only
+	struct cached_chunk *cached[CHUNK_READ_BATCH]; //already in memory
+	struct cached_chunk *fills[CHUNK_READ_BATCH]; //read whole, then cached
+	struct heap_read rds[CHUNK_READ_BATCH];
+};
+
+static void chunk_batch_free(struct chunk_batch *batch)
+{
+	for (int i = 0; i < batch->nr; i++) {
+		run_free(batch->runs[i]);
+		if (batch->cached[i])
+			chunk_cache_put(batch->cached[i]);
+		if (batch->fills[i])
+			chunk_cache_put(batch->fills[i]);
+	}
+	kfree(batch);
+}
+
+//pos is the offset into the first chunk
+struct chunk_batch *chunk_read_batch_start(struct super_block *sb,
+		struct chunk_entry *chunks, int nr, off_t pos, ssize_t count)
+{
+	struct chunk_batch *batch = kzalloc(sizeof(*batch), GFP_NOFS);
+	int i;
+
+	BUG_ON(nr > CHUNK_READ_BATCH);
+	if (!batch)
+		return ERR_PTR(-ENOMEM);
+
+	//everything that can fail first, so nothing is in flight if it does
+	for (i = 0; i < nr && count > 0; i++) {
+		ssize_t len = min(count, (ssize_t)chunks[i].size - (ssize_t)pos);
+		batch->chunks[i] = chunks[i];
+		batch->offs[i] = pos;
+		batch->lens[i] = len;
+		batch->nr = i + 1;
+		if (!chunk_is_hole(&chunks[i]) && chunk_run_members(&chunks[i]) > 1) {
+			batch->runs[i] = run_prepare(sb, &chunks[i], pos, len);
+			if (!batch->runs[i]) {
+				chunk_batch_free(batch);
+				return ERR_PTR(-ENOMEM);
+			}
+		} else if (!chunk_is_hole(&chunks[i])) {
+			bool admit;
+			batch->cached[i] = chunk_cache_get(sb, chunk_loc(&chunks[i]), &admit);
+			//no big deal if there's no memory for it
+			if (admit)
+				batch->fills[i] = chunk_cache_alloc(chunk_loc(&chunks[i]),
+								    chunks[i].size);
+		}
+		count -= len;
+		pos = 0;
+	}
+
+	struct blk_plug plug;
+	blk_start_plug(&plug);
+	for (i = 0; i < batch->nr; i++) {
+		struct chunk_entry *chunk = &batch->chunks[i];
+		if (chunk_is_hole(chunk) || batch->cached[i])
+			continue;
+		if (batch->fills[i])
+			heap_read_start(sb, &batch->rds[i], chunk_data(sb, chunk_loc(chunk)),
+					chunk->size);
+		else if (batch->runs[i])
+			heap_read_start(sb, &batch->rds[i], batch->runs[i]->phys_start,
+					batch->runs[i]->phys_len);
+		else
+			heap_read_start(sb, &batch->rds[i], chunk_data(sb, chunk_loc(chunk))
+					+ batch->offs[i], batch->lens[i]);
+	}
+	blk_finish_plug(&plug);
+	return batch;
+}
+
+static ssize_t run_finish(struct super_block *sb, struct chunk_batch *batch, int i,
+			  struct iov_iter *to)
+{
+	struct run_read *rr = batch->runs[i];
+	struct kvec kv = { .iov_base = rr->buf, .iov_len = rr->phys_len };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, ITER_DEST, &kv, 1, rr->phys_len);
+	if (heap_read_finish(sb, &batch->rds[i], &iter) != rr->phys_len)
+		return 0;
+	return run_copy_out(rr, batch->offs[i], batch->lens[i], to);
 }
 
+static ssize_t fill_finish(struct super_block *sb, struct chunk_batch *batch, int i,
+			   struct iov_iter *to)
+{
+	struct cached_chunk *cc = batch->fills[i];
+	struct kvec kv = { .iov_base = cc->data, .iov_len = cc->length };
+	struct iov_iter iter;
+	ssize_t copied;
+
+	iov_iter_kvec(&iter, ITER_DEST, &kv, 1, cc->length);
+	if (heap_read_finish(sb, &batch->rds[i], &iter) != cc->length)
+		return 0;
+	copied = copy_to_iter(cc->data + batch->offs[i], batch->lens[i], to);
+	batch->fills[i] = NULL;
+	chunk_cache_insert(sb, cc);
+	return copied;
+}
+
+/*
+ * Frees the batch, returns how much was copied. If nothing was, -EIO means
+ * the disk failed and -EFAULT the user buffer.
+ */
+ssize_t chunk_read_batch_finish(struct super_block *sb, struct chunk_batch *batch,
+				struct iov_iter *to)
+{
+	ssize_t done = 0;
+	int err = -EFAULT;
+	int i;
+
+	for (i = 0; i < batch->nr; i++) {
+		ssize_t copied;
+		if (chunk_is_hole(&batch->chunks[i]))
+			copied = iov_iter_zero(batch->lens[i], to);
+		else if (batch->cached[i])
+			copied = copy_to_iter(batch->cached[i]->data + batch->offs[i],
+					      batch->lens[i], to);
+		else if (batch->fills[i])
+			copied = fill_finish(sb, batch, i, to);
+		else if (batch->runs[i])
+			copied = run_finish(sb, batch, i, to);
+		else
+			copied = heap_read_finish(sb, &batch->rds[i], to);
+		done += copied;
+		if (copied != batch->lens[i]) {
+			//holes and cached chunks never started a read, so status is 0
+			if (batch->rds[i].status)
+				err = -EIO;
+			break;
+		}
+	}
+	//something failed, the rest still has to land somewhere
+	while (++i < batch->nr) {
+		if (!chunk_is_hole(&batch->chunks[i]) && !batch->cached[i])
+			heap_read_cancel(&batch->rds[i]);
+	}
+	chunk_batch_free(batch);
+	return done ? done : err;
+}
+
+ssize_t chunk_read_batch(struct super_block *sb, struct chunk_entry *chunks,
+			 int nr, off_t pos, struct iov_iter *to, ssize_t count)
+{
+	struct chunk_batch *batch = chunk_read_batch_start(sb, chunks, nr, pos, count);
+	if (IS_ERR(batch))
+		return PTR_ERR(batch);
+	return chunk_read_batch_finish(sb, batch, to);
+}
+
+/*
+ * O_DIRECT: the part of the chunk that lines up with the device's sectors
+ * and is in whole fs blocks goes straight into the user's pages. The ends
+ * (and everything, if the user buffer isn't aligned for the device) go
+ * through read_data_storage.
+ */
+static ssize_t read_direct_bios(struct super_block *sb, blockoff_t storage,
+				struct iov_iter *to, ssize_t length)
+{
+	struct iov_iter iter = *to;
+	ssize_t done = 0;
+	int err = 0;
+
+	iov_iter_truncate(&iter, length);
+	while (iov_iter_count(&iter)) {
+		struct bio *bio = bio_alloc(sb->s_bdev,
+				bio_iov_vecs_to_alloc(&iter, BIO_MAX_VECS),
+				REQ_OP_READ, GFP_KERNEL);
+		bio->bi_iter.bi_sector = sector_no(sb, storage + done);
+		err = bio_iov_iter_get_pages(bio, &iter);
+		if (err) {
+			bio_put(bio);
+			break;
+		}
+		ssize_t size = bio->bi_iter.bi_size;
+		err = submit_bio_wait(bio);
+		//the pages were written by the device
+		bio_release_pages(bio, true);
+		bio_put(bio);
+		if (err)
+			break;
+		done += size;
+	}
+	iov_iter_advance(to, done);
+	return done ? done : err;
+}
+
+//pos is relative to the chunk
+ssize_t chunk_read_direct(struct super_block *sb, struct chunk_entry *chunk,
+			  off_t pos, ssize_t len, struct iov_iter *to)
+{
+	struct block_device *bdev = sb->s_bdev;
+	unsigned int lbs = bdev_logical_block_size(bdev);
+	ssize_t done, ret;
+
+	len = min(len, (ssize_t)chunk->size - (ssize_t)pos);
+	if (len <= 0)
+		return 0;
+	if (chunk_is_hole(chunk))
+		return iov_iter_zero(len, to);
+	if (chunk_run_members(chunk) > 1)
+		return chunk_read_batch(sb, chunk, 1, pos, to, len);
+
+	blockoff_t data = chunk_data(sb, chunk_loc(chunk));
+	blockoff_t storage = data + pos;
+	ssize_t head = min_t(ssize_t, len, round_up(storage, lbs) - storage);
+	ssize_t mid = round_down(len - head, lbs);
+	//the chunk's partial last block goes through read_data_storage like the ends
+	blockoff_t whole_end = round_down(data + chunk->size, sb->s_blocksize);
+
+	if (storage + head >= whole_end)
+		mid = 0;
+	else
+		mid = min_t(ssize_t, mid, whole_end - (storage + head));
+
+	done = head ? read_data_storage(sb, storage, to, head) : 0;
+	if (done != head)
+		return done;
+
+	struct iov_iter mid_iter = *to;
+	iov_iter_truncate(&mid_iter, mid);
+	if (mid && iov_iter_is_aligned(&mid_iter, bdev_dma_alignment(bdev), lbs - 1)) {
+		ret = read_direct_bios(sb, storage + done, to, mid);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+		if (ret != mid)
+			return done;
+	}
+	if (len - done) {
+		ret = read_data_storage(sb, storage + done, to, len - done);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	return done;
+}
@@ -1,10 +1,8 @@
 #include "cominix.h"
+#include <linux/refcount.h>
 typedef u64 blockoff_t;
 #define HASHTABLE_SIZE (32L << 10) //32 kb
 
-extern blockoff_t hashtable;
-extern blockoff_t global_brk;
-
 //i use this to get the size...
 struct chunk_head {
 	u64 hash;
@@ -14,6 +12,22 @@ struct chunk_head {
 	blockoff_t next;
 };
 
+#define CHUNK_FLAG_FILE 0x1 //the data is a struct file_fingerprint
+#define CHUNK_FLAG_BAD 0x2 //the data couldn't be written, never matches
+
+/*
+ * Chunk data starts on a block boundary and the heads live in a table
+ * with a slot for every block of the heap, so the head of the chunk at
+ * location is found without reading anything. Slots are padded so they
+ * never cross a block.
+ */
+#define CHUNK_HEAD_SLOT 32
+
+static inline blockoff_t chunk_data_end(struct super_block *sb, blockoff_t loc, u64 length)
+{
+	return loc + round_up(length, sb->s_blocksize);
+}
+
 struct chunk {
 	u64 hash;
 	u32 length;
@@ -23,15 +37,85 @@ struct chunk {
 	char data[];
 };
 
+/*
+ * Whole files are also put in the hashtable (with CHUNK_FLAG_FILE), so a
+ * file that was already chunked once can reuse the chunk list of the first
+ * copy instead of being chunked again.
+ */
+struct file_fingerprint {
+	u8 digest[16];
+	u64 size;
+	u32 head;
+	u32 list_size;
+	u32 end;
+	u32 pad;
+};
+
+void chunk_layout_init(struct super_block *sb);
 int chunk_reset_hashtable(struct super_block *sb);
 blockoff_t chunk_search_hashtable(struct super_block *sb, u64 chunk_hash);
+blockoff_t chunk_search_hashtable_flags(struct super_block *sb, u64 chunk_hash, u16 flags);
+
+//how many chunks a read sends to the disk at once
+#define CHUNK_READ_BATCH 16
+ssize_t chunk_read_batch(struct super_block *sb, struct chunk_entry *chunks,
+			 int nr, off_t pos, struct iov_iter *to, ssize_t count);
+struct chunk_batch;
+struct chunk_batch *chunk_read_batch_start(struct super_block *sb,
+		struct chunk_entry *chunks, int nr, off_t pos, ssize_t count);
+ssize_t chunk_read_batch_finish(struct super_block *sb, struct chunk_batch *batch,
+				struct iov_iter *to);
+ssize_t chunk_read_direct(struct super_block *sb, struct chunk_entry *chunk,
+			  off_t pos, ssize_t len, struct iov_iter *to);
+int chunk_read_data(struct super_block *sb, blockoff_t chunk, void *buf, ssize_t length);
 //only fill if you know it isn't already in the table
 blockoff_t chunk_fill_hashtable(struct super_block *sb, 
 			struct chunk *metadata, char *data);
 
+/*
+ * The part of the heap a chunker has taken for itself, and the writes it
+ * has to wait for. Start it with chunk_extent_start and release it when
+ * done. Every block of the heap belongs to one chunk (or to nobody), so
+ * chunkers never write the same block.
+ */
+struct heap_extent {
+	blockoff_t next;
+	blockoff_t end;
+	u64 left; //how much the file still has to chunk, so the next piece isn't too big
+	u64 write_seq; //the last write it has to wait for
+	errseq_t write_err;
+};
+#define HEAP_EXTENT_SIZE (1 << 20)
+void chunk_extent_start(struct super_block *sb, struct heap_extent *ext);
+void chunk_extent_release(struct super_block *sb, struct heap_extent *ext);
+int chunk_wait_writes(struct super_block *sb, struct heap_extent *ext);
+void chunk_wait_all_writes(struct super_block *sb);
+blockoff_t chunk_find_or_fill(struct super_block *sb, struct chunk *metadata,
+			      char *data, struct heap_extent *ext, bool *added);
+
+/*
+ * Chunks read from lots of files stay in memory (see chunk_cache.c).
+ * data is only valid while the reference is held.
+ */
+struct cached_chunk {
+	struct hlist_node hash;
+	struct list_head lru;
+	refcount_t ref; //one for being in the cache, one for each reader
+	blockoff_t loc;
+	u32 length;
+	char data[];
+};
+
+int chunk_cache_init(struct super_block *sb);
+void chunk_cache_exit(struct super_block *sb);
+struct cached_chunk *chunk_cache_get(struct super_block *sb, blockoff_t loc, bool *admit);
+struct cached_chunk *chunk_cache_alloc(blockoff_t loc, u64 length);
+void chunk_cache_insert(struct super_block *sb, struct cached_chunk *cc);
+void chunk_cache_put(struct cached_chunk *cc);
+
 //pos is relative to the chunk
 int chunk_copy_into_buffer(struct super_block *sb, 
 	struct chunk_entry *chunk, 
-	char *buf, ssize_t count, off_t pos);
+	struct iov_iter *to, ssize_t count, off_t pos);
 
 void *load_blockoff(struct super_block *sb, blockoff_t off, ssize_t *bytes_left, struct buffer_head **bh);
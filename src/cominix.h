@@ -4,6 +4,9 @@
 
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/percpu_counter.h>
+#include <linux/errseq.h>
+#include <linux/llist.h>
 #include "cominix_fs.h"
 #include <linux/buffer_head.h>
 
@@ -15,6 +18,23 @@
 typedef u32 block_t;
 typedef u64 blockoff_t;
 
+/*
+ * A request to chunk a file (see cominix_ioctl.h). The last job stays
+ * attached to the inode so its result can be read back.
+ */
+struct cominix_chunk_job {
+	struct work_struct work;
+	struct file *filp;
+	u32 flags;
+	u32 state;
+	int error;
+	atomic64_t bytes_done;
+	u64 bytes_total;
+	u64 nr_chunks;
+	u64 nr_new_chunks;
+	u64 new_bytes;
+};
+
 /*
  * cominix fs inode data in memory
  */
@@ -23,10 +43,22 @@ struct cominix_inode_info {
 		__u16 i1_data[16];
 		__u32 i2_data[16];
 	} u;
+	struct cominix_chunk_job *i_chunk_job; /* protected by i_lock */
+	u32 i_write_gen; /* bumped by every write and truncate, under i_rwsem */
+	u32 i_alloc_goal; /* the block after the last one allocated, a hint */
+	struct rw_semaphore i_ext_sem; /* the extent list, see extent.c */
+	u32 i_ext_stale; /* extents from this block on should have been truncated */
+	struct cominix_ext_index *i_ext_index; /* under i_ext_sem, NULL until it's needed */
+	struct cached_list __rcu *i_cached_list; /* see list_cache.c */
+	struct list_head i_cached_lru; /* on cominix_sb_info.cached_lists */
 	struct inode vfs_inode;
 };
 
 
+#define CHUNK_BUCKET_LOCKS 64
+//pieces of the heap that chunkers took and didn't use, see chunk_extent_release
+#define HEAP_FREE_TAILS 16
+
 /*
  * cominix super-block data in memory
  */
@@ -41,6 +73,11 @@ struct cominix_sb_info {
 	int s_namelen;
 	struct buffer_head ** s_imap;
 	struct buffer_head ** s_zmap;
+	u32 *s_zmap_free; /* free zones in each zmap block */
+	unsigned long s_zone_cursor; /* zmap bit after the last allocation */
+	struct percpu_counter s_freezones_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct percpu_counter s_dirtyzones_counter; /* reserved by delayed allocation */
 	struct buffer_head * s_sbh;
 	struct cominix_super_block * s_ms;
 	unsigned short s_mount_state;
@@ -50,6 +87,28 @@ struct cominix_sb_info {
 	blockoff_t hashtable_size;
 	blockoff_t heap_brk;
 	blockoff_t max_brk;
+	blockoff_t headers; /* the chunk head table, right after the hashtable */
+	blockoff_t heap_start; /* first block of chunk data */
+	u32 chunk_layout; /* CHUNK_LAYOUT_*, inline heaps are only read */
+	spinlock_t heap_write_lock;
+	struct list_head heap_writes; /* chunk data bios in flight, oldest first */
+	u64 heap_write_seq; /* of the last one sent */
+	struct llist_head heap_failed_writes; /* chunks to poison */
+	errseq_t heap_write_err;
+	wait_queue_head_t heap_write_wq;
+	spinlock_t cached_list_lock;
+	struct list_head cached_lists;
+	long nr_cached_lists;
+	struct shrinker *cached_list_shrinker;
+	struct chunk_cache *chunk_cache; /* see chunk_cache.c */
+	spinlock_t bitmap_lock;
+	rwlock_t pointers_lock; /* indirect block pointers of every inode */
+	struct mutex brk_lock;
+	struct {
+		blockoff_t start, end;
+	} heap_tails[HEAP_FREE_TAILS]; /* under brk_lock, only kept in memory */
+	int nr_heap_tails;
+	struct mutex bucket_locks[CHUNK_BUCKET_LOCKS]; /* see chunk_handler.c */
 };
 
 extern struct inode *cominix_iget(struct super_block *, unsigned long);
@@ -60,7 +119,17 @@ extern void cominix_free_inode(struct inode * inode);
 extern unsigned long cominix_count_free_inodes(struct super_block *sb);
 extern int cominix_new_block(struct inode * inode);
 extern int cominix_new_block_sb(struct super_block *sb);
+extern int cominix_new_blocks_sb(struct super_block *sb, unsigned long goal, int *count,
+				 int flags);
+/* what an allocation may take from, see claim_blocks in bitmap.c */
+#define COMINIX_ALLOC_DELAYED	0x1 /* data for delayed buffers, already reserved */
+#define COMINIX_ALLOC_MARGIN	0x2 /* pointer and extent blocks for writing those back */
+extern int cominix_init_free_counts(struct super_block *sb);
+extern void cominix_destroy_free_counts(struct super_block *sb);
+extern int cominix_reserve_block(struct super_block *sb);
+extern void cominix_release_blocks(struct super_block *sb, int count);
 extern void cominix_free_block(struct inode *inode, unsigned long block);
+extern void cominix_free_block_sb(struct super_block *sb, unsigned long block);
 extern unsigned long cominix_count_free_blocks(struct super_block *sb);
 extern int cominix_getattr(struct mnt_idmap *, const struct path *,
 		struct kstat *, u32, unsigned int);
@@ -73,6 +142,9 @@ extern int V1_cominix_get_block(struct inode *, long, struct buffer_head *, int)
 extern int V2_cominix_get_block(struct inode *, long, struct buffer_head *, int);
 extern unsigned V1_cominix_blocks(loff_t, struct super_block *);
 extern unsigned V2_cominix_blocks(loff_t, struct super_block *);
+extern int cominix_extent_get_block(struct inode *, sector_t, struct buffer_head *, int);
+extern void cominix_extent_truncate(struct inode *);
+extern int cominix_extent_blocks(struct inode *, u64 *);
 
 struct cominix_dir_entry *cominix_find_entry(struct dentry*, struct folio**);
 int cominix_add_link(struct dentry*, struct inode*);
@@ -88,6 +160,7 @@ extern const struct inode_operations cominix_file_inode_operations;
 extern const struct inode_operations cominix_dir_inode_operations;
 extern const struct file_operations cominix_file_operations;
 extern const struct file_operations cominix_dir_operations;
+extern const struct address_space_operations chunked_aops;
 
 
 int cominix_write_inode(struct inode *inode, struct writeback_control *wbc);
@@ -97,6 +170,33 @@ struct chunk_entry {
 	u64 location;
 	u64 size;
 };
+//zeroes that were never stored, the size can be anything
+#define CHUNK_LOC_HOLE ((u64)-1)
+
+static inline bool chunk_is_hole(struct chunk_entry *chunk)
+{
+	return chunk->location == CHUNK_LOC_HOLE;
+}
+
+/*
+ * Chunks that are right after each other in the heap share one entry (a
+ * run). The top bits of the location count the chunks after the first
+ * one and the size is all of their data together.
+ */
+#define CHUNK_LOC_BITS 48
+#define CHUNK_RUN_MAX 32
+//and no more data than this, so reading a whole run stays a few bios
+#define CHUNK_RUN_BYTES (512 << 10)
+
+static inline blockoff_t chunk_loc(struct chunk_entry *chunk)
+{
+	return chunk->location & ((1ULL << CHUNK_LOC_BITS) - 1);
+}
+
+static inline unsigned int chunk_run_members(struct chunk_entry *chunk)
+{
+	return (chunk->location >> CHUNK_LOC_BITS) + 1;
+}
 
 static inline struct cominix_sb_info *cominix_sb(struct super_block *sb)
 {
@@ -115,7 +215,17 @@ static inline unsigned cominix_blocks_needed(unsigned bits, unsigned blocksize)
 
 void __init cminix_proc_init(void);
 void cminix_proc_clean(void);
+int cominix_chunk_file(struct file *filp, struct cominix_chunk_job *job);
+int cominix_chunk_submit(struct file *filp, u32 flags);
+long cominix_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int __init cominix_chunk_init(void);
+void cominix_chunk_exit(void);
 extern struct file_system_type cominix_fs_type;
+int cached_list_collect(struct inode *inode, loff_t pos, loff_t end,
+			struct chunk_entry *out, int max, loff_t *start);
+void cached_list_drop(struct inode *inode);
+int cached_list_init_sb(struct super_block *sb);
+void cached_list_exit_sb(struct super_block *sb);
 extern const struct file_operations chunked_file_operations;
 
 static inline block_t *i_data(struct inode *inode)
@@ -135,6 +245,24 @@ static int inode_is_chunked(struct inode *inode)
 	    && (i_data(inode)[9] == (u32)-1);
 }
 
+static inline int cominix_extents_per_block(struct super_block *sb)
+{
+	return (sb->s_blocksize - sizeof(block_t)) / sizeof(struct cominix_extent);
+}
+
+//same hack, new regular files are mapped by extents instead of the tree
+static inline void switch_inode_to_extents(struct inode *inode)
+{
+	i_data(inode)[0] = (u32)-2;
+	i_data(inode)[9] = (u32)-2;
+}
+
+static inline int inode_is_extent(struct inode *inode)
+{
+	return (i_data(inode)[0] == (u32)-2)
+	    && (i_data(inode)[9] == (u32)-2);
+}
+
 
 
 #if defined(CONFIG_MINIX_FS_NATIVE_ENDIAN) && \
@@ -159,6 +287,8 @@ static int inode_is_chunked(struct inode *inode)
 	test_bit((nr), (unsigned long *)(addr))
 #define cominix_find_first_zero_bit(addr, size) \
 	find_first_zero_bit((unsigned long *)(addr), (size))
+#define cominix_find_next_zero_bit(addr, size, offset) \
+	find_next_zero_bit((unsigned long *)(addr), (size), (offset))
 
 #elif defined(CONFIG_MINIX_FS_BIG_ENDIAN_16BIT_INDEXED)
 
@@ -197,6 +327,14 @@ static inline int cominix_test_bit(int nr, const void *vaddr)
 	return (p[nr >> 4] & (1U << (nr & 15))) != 0;
 }
 
+static inline int cominix_find_next_zero_bit(const void *vaddr, unsigned size,
+					     unsigned offset)
+{
+	while (offset < size && cominix_test_bit(offset, vaddr))
+		offset++;
+	return offset;
+}
+
 #else
 
 /*
@@ -208,6 +346,7 @@ static inline int cominix_test_bit(int nr, const void *vaddr)
 #define cominix_test_and_clear_bit	__test_and_clear_bit_le
 #define cominix_test_bit	test_bit_le
 #define cominix_find_first_zero_bit	find_first_zero_bit_le
+#define cominix_find_next_zero_bit	find_next_zero_bit_le
 
 #endif
 
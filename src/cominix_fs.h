@@ -102,6 +102,17 @@ struct cminix_extra_super_block {
 	__u64 hashtable_location;
 	__u32 hashtable_size;
 	__u64 heap_brk;
+	__u32 chunk_layout;
+};
+
+#define CHUNK_LAYOUT_INLINE	0	/* heads right before the data, read only */
+#define CHUNK_LAYOUT_SPLIT	1	/* heads in their own table, data block aligned */
+
+/* a run of an extent mapped file, see extent.c */
+struct cominix_extent {
+	__u32 lblk;	/* first block in the file */
+	__u32 pblk;	/* where it is on disk */
+	__u32 len;
 };
 
 struct cominix_dir_entry {
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _LINUX_COMINIX_IOCTL_H
+#define _LINUX_COMINIX_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Chunking a file through an fd instead of writing its path to
+ * /proc/fs/cominix/chunker. The fd needs to be readable and you need
+ * to own the file.
+ */
+
+#define COMINIX_CHUNK_ASYNC	0x0001	/* queue the job and return at once */
+#define COMINIX_CHUNK_DRY_RUN	0x0002	/* only count chunks, change nothing */
+#define COMINIX_CHUNK_PRIORITY	0x0004	/* use the high priority queue */
+#define COMINIX_CHUNK_FLAGS	(COMINIX_CHUNK_ASYNC | \
+				 COMINIX_CHUNK_DRY_RUN | \
+				 COMINIX_CHUNK_PRIORITY)
+
+struct cominix_chunk_args {
+	__u32 flags;
+	__u32 pad;
+};
+
+/* cominix_chunk_status.state */
+#define COMINIX_CHUNK_NONE	0	/* nothing was ever submitted */
+#define COMINIX_CHUNK_QUEUED	1
+#define COMINIX_CHUNK_RUNNING	2
+#define COMINIX_CHUNK_DONE	3	/* look at error */
+
+struct cominix_chunk_status {
+	__u32 state;
+	__s32 error;		/* 0 or a negative errno */
+	__u32 flags;		/* what the job was submitted with */
+	__u32 pad;
+	__u64 bytes_done;
+	__u64 bytes_total;
+	__u64 nr_chunks;	/* entries in the chunk list */
+	__u64 nr_new_chunks;	/* chunks that weren't in the hashtable */
+	__u64 new_bytes;	/* bytes added to the heap */
+};
+
+#define FS_IOC_COMINIX_CHUNK		_IOW('C', 1, struct cominix_chunk_args)
+#define FS_IOC_COMINIX_CHUNK_STATUS	_IOR('C', 2, struct cominix_chunk_status)
+
+#endif
@@ -0,0 +1,512 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Extent mapped normal files. New regular files keep a sorted list of
+ * (file block, disk block, length) runs instead of the indirect tree, so a
+ * lookup maps a whole run at once and a big file isn't four reads deep.
+ *
+ * The list lives in a chain of blocks like the chunk lists: the extents
+ * from the start of each block, the next block in the last 4 bytes. A
+ * block's extents end at the first one with len 0, so any block can have
+ * free slots. A full block is split in two when something goes in the
+ * middle of it, which keeps an insert to two blocks.
+ *
+ * i_data[1] is the first block, i_data[2] the number of extents and
+ * i_data[3] the last block. Readers take i_ext_sem shared, anything that
+ * changes the list takes it exclusive.
+ */
+
+#include "cominix.h"
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+
+/*
+ * Where each block of the chain starts, so a lookup reads just the block
+ * its extent is in. Built from the chain the first time the inode needs
+ * it and kept up to date under i_ext_sem after that.
+ */
+struct cominix_ext_index {
+	int nr;
+	int size;
+	u64 data_blocks; //all the extents' lengths together
+	struct ext_index_block {
+		block_t blk;
+		u32 lblk; //of its first extent
+		u32 nr;
+	} blocks[];
+};
+
+static block_t *next_block(struct super_block *sb, struct buffer_head *bh)
+{
+	return (block_t *)(bh->b_data + sb->s_blocksize) - 1;
+}
+
+static u32 ext_end(struct cominix_extent *ext)
+{
+	return ext->lblk + ext->len;
+}
+
+//room for one more block in the index, so nothing fails once the chain changes
+static int ext_index_reserve(struct cominix_inode_info *ci)
+{
+	struct cominix_ext_index *idx = ci->i_ext_index;
+	int size = idx ? idx->size * 2 : 4;
+
+	if (idx && idx->nr < idx->size)
+		return 0;
+	idx = krealloc(idx, struct_size(idx, blocks, size), GFP_NOFS);
+	if (!idx)
+		return -ENOMEM;
+	if (!ci->i_ext_index) {
+		idx->nr = 0;
+		idx->data_blocks = 0;
+	}
+	idx->size = size;
+	ci->i_ext_index = idx;
+	return 0;
+}
+
+static void ext_index_insert(struct cominix_ext_index *idx, int b, block_t blk,
+			     u32 lblk, u32 nr)
+{
+	memmove(&idx->blocks[b + 1], &idx->blocks[b], (idx->nr - b) * sizeof(idx->blocks[0]));
+	idx->blocks[b] = (struct ext_index_block){ blk, lblk, nr };
+	idx->nr++;
+}
+
+//the last block that starts at or before block, -1 if there's none
+static int ext_index_find(struct cominix_ext_index *idx, u32 block)
+{
+	int lo = 0, hi = idx->nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (idx->blocks[mid].lblk <= block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+//called with i_ext_sem held exclusive
+static int ext_index_load(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct cominix_inode_info *ci = cominix_i(inode);
+	int per_block = cominix_extents_per_block(sb);
+	block_t cur = i_data(inode)[1];
+	u32 left = i_data(inode)[2];
+	int err = ext_index_reserve(ci);
+
+	while (!err && cur && left) {
+		struct buffer_head *bh = sb_bread(sb, cur);
+		struct cominix_extent *ext;
+		struct cominix_ext_index *idx;
+		u32 n = 0;
+
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		ext = (struct cominix_extent *)bh->b_data;
+		while (n < per_block && ext[n].len)
+			n++;
+		err = -EIO;
+		if (!n || n > left) {
+			brelse(bh);
+			break;
+		}
+		err = ext_index_reserve(ci);
+		if (!err) {
+			idx = ci->i_ext_index;
+			ext_index_insert(idx, idx->nr, cur, ext[0].lblk, n);
+			for (u32 i = 0; i < n; i++)
+				idx->data_blocks += ext[i].len;
+			left -= n;
+			cur = *next_block(sb, bh);
+		}
+		brelse(bh);
+	}
+	if (!err && left)
+		err = -EIO;
+	if (err) {
+		kfree(ci->i_ext_index);
+		ci->i_ext_index = NULL;
+	}
+	return err;
+}
+
+//i_ext_sem shared, with the index there
+static int ext_read_lock(struct inode *inode)
+{
+	struct cominix_inode_info *ci = cominix_i(inode);
+	int err = 0;
+
+	down_read(&ci->i_ext_sem);
+	if (ci->i_ext_index)
+		return 0;
+	up_read(&ci->i_ext_sem);
+	down_write(&ci->i_ext_sem);
+	if (!ci->i_ext_index)
+		err = ext_index_load(inode);
+	downgrade_write(&ci->i_ext_sem);
+	if (err)
+		up_read(&ci->i_ext_sem);
+	return err;
+}
+
+static int ext_write_lock(struct inode *inode)
+{
+	struct cominix_inode_info *ci = cominix_i(inode);
+	int err = 0;
+
+	down_write(&ci->i_ext_sem);
+	if (!ci->i_ext_index)
+		err = ext_index_load(inode);
+	if (err)
+		up_write(&ci->i_ext_sem);
+	return err;
+}
+
+/*
+ * Finds the extent with block in it and copies it to *found. If there
+ * isn't one, *next is where the next extent starts (or U32_MAX) and *prev
+ * is the one before the hole, len 0 if there's none.
+ */
+static int find_extent(struct inode *inode, u32 block, struct cominix_extent *found,
+		       struct cominix_extent *prev, u32 *next)
+{
+	struct super_block *sb = inode->i_sb;
+	struct cominix_ext_index *idx = cominix_i(inode)->i_ext_index;
+	int b = ext_index_find(idx, block);
+	struct buffer_head *bh;
+	struct cominix_extent *ext;
+	u32 i;
+
+	*next = U32_MAX;
+	if (prev)
+		prev->len = 0;
+	if (b < 0) {
+		if (idx->nr)
+			*next = idx->blocks[0].lblk;
+		return 0;
+	}
+	bh = sb_bread(sb, idx->blocks[b].blk);
+	if (!bh)
+		return -EIO;
+	ext = (struct cominix_extent *)bh->b_data;
+	for (i = 0; i < idx->blocks[b].nr; i++) {
+		if (block < ext[i].lblk) {
+			*next = ext[i].lblk;
+			break;
+		}
+		if (block < ext_end(&ext[i])) {
+			*found = ext[i];
+			brelse(bh);
+			return 1;
+		}
+		if (prev)
+			*prev = ext[i];
+	}
+	if (i == idx->blocks[b].nr && b + 1 < idx->nr)
+		*next = idx->blocks[b + 1].lblk;
+	brelse(bh);
+	return 0;
+}
+
+static struct buffer_head *new_chain_block(struct inode *inode, int alloc_flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int one = 1;
+	block_t blk = cominix_new_blocks_sb(sb, 0, &one, alloc_flags);
+
+	if (!blk)
+		return ERR_PTR(-ENOSPC);
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		cominix_free_block_sb(sb, blk);
+		return ERR_PTR(-ENOMEM);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	return bh;
+}
+
+/*
+ * Called with i_ext_sem held exclusive. Only the block new goes in is
+ * read. When that's full, a new block after it takes the second half (or
+ * just new, if it goes on the end, which is how files mostly grow).
+ */
+static int insert_extent(struct inode *inode, struct cominix_extent *new, int alloc_flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct cominix_inode_info *ci = cominix_i(inode);
+	int per_block = cominix_extents_per_block(sb);
+	struct cominix_ext_index *idx;
+	struct buffer_head *bh, *nbh = NULL;
+	struct cominix_extent *ext;
+	struct ext_index_block *ent;
+	u32 n, i;
+	int b, err;
+
+	err = ext_index_reserve(ci);
+	if (err)
+		return err;
+	idx = ci->i_ext_index;
+	if (!idx->nr) {
+		bh = new_chain_block(inode, alloc_flags);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		((struct cominix_extent *)bh->b_data)[0] = *new;
+		i_data(inode)[1] = bh->b_blocknr;
+		i_data(inode)[3] = bh->b_blocknr;
+		ext_index_insert(idx, 0, bh->b_blocknr, new->lblk, 1);
+		brelse(bh);
+		goto out;
+	}
+	//before everything else goes in the first block
+	b = max(ext_index_find(idx, new->lblk), 0);
+	ent = &idx->blocks[b];
+	bh = sb_bread(sb, ent->blk);
+	if (!bh)
+		return -EIO;
+	ext = (struct cominix_extent *)bh->b_data;
+	n = ent->nr;
+	for (i = n; i > 0 && ext[i - 1].lblk > new->lblk; i--)
+		;
+	if (i > 0 && ext_end(&ext[i - 1]) == new->lblk &&
+	    ext[i - 1].pblk + ext[i - 1].len == new->pblk) {
+		ext[i - 1].len += new->len;
+		mark_buffer_dirty_inode(bh, inode);
+		brelse(bh);
+		idx->data_blocks += new->len;
+		mark_inode_dirty(inode);
+		return 0;
+	}
+	if (n == per_block) {
+		u32 split = i == n ? n : n / 2;
+
+		nbh = new_chain_block(inode, alloc_flags);
+		if (IS_ERR(nbh)) {
+			brelse(bh);
+			return PTR_ERR(nbh);
+		}
+		memcpy(nbh->b_data, &ext[split], (n - split) * sizeof(*ext));
+		memset(&ext[split], 0, (n - split) * sizeof(*ext));
+		*next_block(sb, nbh) = *next_block(sb, bh);
+		*next_block(sb, bh) = nbh->b_blocknr;
+		if (b == idx->nr - 1)
+			i_data(inode)[3] = nbh->b_blocknr;
+		ext_index_insert(idx, b + 1, nbh->b_blocknr, 0, n - split);
+		ent = &idx->blocks[b];
+		ent->nr = n = split;
+		if (i >= split) {
+			//new goes in the new block
+			mark_buffer_dirty_inode(bh, inode);
+			brelse(bh);
+			bh = nbh;
+			nbh = NULL;
+			ent++;
+			ext = (struct cominix_extent *)bh->b_data;
+			i -= split;
+			n = ent->nr;
+		}
+	}
+	memmove(&ext[i + 1], &ext[i], (n - i) * sizeof(*ext));
+	ext[i] = *new;
+	ent->nr = n + 1;
+	ent->lblk = ext[0].lblk;
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+	if (nbh) {
+		idx->blocks[b + 1].lblk = ((struct cominix_extent *)nbh->b_data)[0].lblk;
+		brelse(nbh);
+	}
+out:
+	i_data(inode)[2]++;
+	idx->data_blocks += new->len;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Maps as much of the run from block as bh->b_size asks for. Allocating
+ * fills the hole up to the next extent in one piece if the bitmap allows.
+ */
+int cominix_extent_get_block(struct inode *inode, sector_t block,
+			     struct buffer_head *bh, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct cominix_inode_info *ci = cominix_i(inode);
+	u32 max = max_t(u32, bh->b_size >> inode->i_blkbits, 1);
+	struct cominix_extent ext, prev;
+	//a delayed buffer's data was reserved, its chain blocks come from the margin
+	int flags = buffer_delay(bh) ? COMINIX_ALLOC_DELAYED : 0;
+	unsigned long goal;
+	u32 next;
+	int count, ret;
+
+	if (block >= U32_MAX)
+		return -EFBIG;
+	//a failed truncate left old extents from here on, they aren't the file's
+	if (block >= READ_ONCE(ci->i_ext_stale))
+		return -EIO;
+	ret = ext_read_lock(inode);
+	if (ret)
+		return ret;
+	ret = find_extent(inode, block, &ext, NULL, &next);
+	up_read(&ci->i_ext_sem);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		goto mapped;
+	if (!create) {
+		bh->b_size = (size_t)min_t(u32, max, next - block) << inode->i_blkbits;
+		return 0;
+	}
+
+	ret = ext_write_lock(inode);
+	if (ret)
+		return ret;
+	ret = find_extent(inode, block, &ext, &prev, &next);
+	if (ret) {
+		up_write(&ci->i_ext_sem);
+		if (ret < 0)
+			return ret;
+		goto mapped;
+	}
+	count = min_t(u32, max, next - block);
+	goal = prev.len ? prev.pblk + prev.len + (block - ext_end(&prev))
+			: READ_ONCE(ci->i_alloc_goal);
+	ext.lblk = block;
+	ext.pblk = cominix_new_blocks_sb(sb, goal, &count, flags);
+	ext.len = count;
+	if (!ext.pblk) {
+		up_write(&ci->i_ext_sem);
+		return -ENOSPC;
+	}
+	ret = insert_extent(inode, &ext, flags ? COMINIX_ALLOC_MARGIN : 0);
+	if (ret) {
+		up_write(&ci->i_ext_sem);
+		for (int i = 0; i < count; i++)
+			cominix_free_block(inode, ext.pblk + i);
+		return ret;
+	}
+	up_write(&ci->i_ext_sem);
+	WRITE_ONCE(ci->i_alloc_goal, ext.pblk + count);
+	inode_set_ctime_current(inode);
+	set_buffer_new(bh);
+
+mapped:
+	map_bh(bh, sb, ext.pblk + (block - ext.lblk));
+	bh->b_size = (size_t)min_t(u32, max, ext_end(&ext) - block) << inode->i_blkbits;
+	return 0;
+}
+
+/*
+ * Frees everything past i_size. Extents are sorted so it's all at the end,
+ * and only the blocks of the chain that have some of it are read.
+ */
+void cominix_extent_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct cominix_inode_info *ci = cominix_i(inode);
+	u32 first = DIV_ROUND_UP(inode->i_size, sb->s_blocksize);
+	struct cominix_ext_index *idx;
+	int err;
+
+	block_truncate_page(inode->i_mapping, inode->i_size, cominix_extent_get_block);
+
+	down_write(&ci->i_ext_sem);
+	err = ci->i_ext_index ? 0 : ext_index_load(inode);
+	idx = ci->i_ext_index;
+	while (!err && idx->nr) {
+		int b = idx->nr - 1;
+		struct ext_index_block *ent = &idx->blocks[b];
+		//all of it goes, so the block before can't point at it anymore
+		bool whole = ent->lblk >= first;
+		struct buffer_head *bh, *pbh = NULL;
+		struct cominix_extent *ext;
+
+		if (whole && b) {
+			pbh = sb_bread(sb, idx->blocks[b - 1].blk);
+			if (!pbh) {
+				err = -EIO;
+				break;
+			}
+		}
+		bh = sb_bread(sb, ent->blk);
+		if (!bh) {
+			brelse(pbh);
+			err = -EIO;
+			break;
+		}
+		ext = (struct cominix_extent *)bh->b_data;
+		while (ent->nr) {
+			struct cominix_extent *e = &ext[ent->nr - 1];
+			u32 from = max(first, e->lblk);
+			if (ext_end(e) <= first)
+				break;
+			for (u32 i = from; i < ext_end(e); i++)
+				cominix_free_block(inode, e->pblk + (i - e->lblk));
+			idx->data_blocks -= ext_end(e) - from;
+			mark_buffer_dirty_inode(bh, inode);
+			if (e->lblk < first) {
+				e->len = first - e->lblk;
+				break;
+			}
+			memset(e, 0, sizeof(*e));
+			ent->nr--;
+			i_data(inode)[2]--;
+		}
+		if (!whole) {
+			brelse(bh);
+			break;
+		}
+		//chain blocks that hold nothing anymore
+		bforget(bh);
+		cominix_free_block(inode, ent->blk);
+		idx->nr--;
+		if (pbh) {
+			*next_block(sb, pbh) = 0;
+			mark_buffer_dirty_inode(pbh, inode);
+			i_data(inode)[3] = pbh->b_blocknr;
+			brelse(pbh);
+		} else {
+			i_data(inode)[1] = 0;
+			i_data(inode)[3] = 0;
+		}
+	}
+	if (err) {
+		//their blocks leak, but the file can't grow back over them
+		WARN(1, "cominix: couldn't truncate extents of inode %lu (%d)\n",
+		     inode->i_ino, err);
+		WRITE_ONCE(ci->i_ext_stale, min(ci->i_ext_stale, first));
+	} else if (first <= ci->i_ext_stale) {
+		//nothing from first on is left, stale or not
+		WRITE_ONCE(ci->i_ext_stale, U32_MAX);
+	}
+	up_write(&ci->i_ext_sem);
+	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+	mark_inode_dirty(inode);
+}
+
+/*
+ * What the file takes on disk for getattr: the extents and the chain
+ * blocks. Blocks waiting for delayed allocation aren't in there yet.
+ */
+int cominix_extent_blocks(struct inode *inode, u64 *blocks)
+{
+	struct cominix_inode_info *ci = cominix_i(inode);
+	int err = ext_read_lock(inode);
+
+	if (err)
+		return err;
+	*blocks = ci->i_ext_index->data_blocks + ci->i_ext_index->nr;
+	up_read(&ci->i_ext_sem);
+	return 0;
+}
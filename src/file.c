@@ -14,6 +14,7 @@
 #include <linux/writeback.h>
 #include <linux/buffer_head.h>
 #include "linked_list.h"
+#include "cominix_ioctl.h"
 
 static block_t get_list_head(struct inode *inode)
 {
@@ -21,33 +22,352 @@ static block_t get_list_head(struct inode *inode)
 }
 
 void dump_head(struct super_block *sb, block_t block);
-static ssize_t 
-chunked_file_read(struct file *filp,
-		char __user *buf,
-		size_t count,
-		loff_t *pos)
-{
-	//printk("pos %lld < size %lld", *pos, filp->f_inode->i_size);
-	if (*pos >= filp->f_inode->i_size)
-		return 0;
-	struct inode *inode = filp->f_inode;
+
+//from the cached copy of the list if there is (or can be) one
+static int collect_chunks(struct inode *inode, loff_t pos, loff_t end,
+			  struct chunk_entry *out, int max, loff_t *start)
+{
+	int nr = cached_list_collect(inode, pos, end, out, max, start);
+	if (nr >= 0)
+		return nr;
+	return ll_collect(inode->i_sb, get_list_head(inode), pos, end, out, max, start);
+}
+
+/*
+ * Copies [pos, pos + count) of a chunked file into the iter. Finds a batch
+ * of chunks with one walk of the list and reads them all at once, since
+ * the chunks of a deduplicated file are all over the heap.
+ */
+static ssize_t chunked_read_range(struct inode *inode, loff_t pos,
+				  struct iov_iter *to, ssize_t count)
+{
 	struct super_block *sb = inode->i_sb;
+	struct chunk_entry chunks[CHUNK_READ_BATCH];
+	ssize_t done = 0;
 	BUG_ON(!inode_is_chunked(inode));
 
-	ssize_t found_pos = 0;
-	//dump_head(sb, zones[1]);
-	struct chunk_entry chunk 
-		= ll_search_left(sb, get_list_head(inode), *pos, &found_pos);
-	BUG_ON(!chunk.location);
-	BUG_ON(!chunk.size);
-	off_t in_chunk_offset = *pos - found_pos;
-	int ret = chunk_copy_into_buffer(sb,
-			&chunk, buf, count, in_chunk_offset);
-	if (ret > 0)
-		*pos += ret;
+	while (done < count) {
+		loff_t found_pos = 0;
+		int nr = collect_chunks(inode, pos + done,
+				    pos + count, chunks,
+				    CHUNK_READ_BATCH, &found_pos);
+		if (WARN_ON(!nr))
+			return done ? done : -EIO;
+		ssize_t ret = chunk_read_batch(sb, chunks, nr,
+				pos + done - found_pos, to, count - done);
+		if (ret <= 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	return done;
+}
+
+//doesn't touch the page cache, the chunks are read into the user's pages
+static ssize_t chunked_direct_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	struct chunk_entry chunks[CHUNK_READ_BATCH];
+	ssize_t done = 0;
+
+	while (iov_iter_count(to) && iocb->ki_pos < inode->i_size) {
+		loff_t found_pos = 0;
+		ssize_t count = min_t(loff_t, iov_iter_count(to),
+				      inode->i_size - iocb->ki_pos);
+		int nr = collect_chunks(inode, iocb->ki_pos,
+				    iocb->ki_pos + count, chunks,
+				    CHUNK_READ_BATCH, &found_pos);
+		if (WARN_ON(!nr))
+			return done ? done : -EIO;
+		off_t in_chunk = iocb->ki_pos - found_pos;
+		for (int i = 0; i < nr && count; i++) {
+			ssize_t want = min_t(ssize_t, count, chunks[i].size - in_chunk);
+			ssize_t ret = chunk_read_direct(sb, &chunks[i], in_chunk, want, to);
+			if (ret <= 0)
+				return done ? done : ret;
+			iocb->ki_pos += ret;
+			done += ret;
+			count -= ret;
+			if (ret != want)
+				return done;
+			in_chunk = 0;
+		}
+	}
+	file_accessed(iocb->ki_filp);
+	return done;
+}
+
+/*
+ * Buffered reads with IOCB_NOWAIT are handled by filemap_read, since our
+ * readahead never waits. Direct reads always wait on the disk, so those
+ * get -EAGAIN and io_uring retries them from a worker.
+ */
+static ssize_t chunked_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			return -EAGAIN;
+		return chunked_direct_read(iocb, to);
+	}
+	return generic_file_read_iter(iocb, to);
+}
+
+static int chunked_file_open(struct inode *inode, struct file *filp)
+{
+	filp->f_mode |= FMODE_NOWAIT;
+	return generic_file_open(inode, filp);
+}
+
+static int chunked_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	loff_t pos = folio_pos(folio);
+	ssize_t len = clamp_t(loff_t, i_size_read(inode) - pos, 0, folio_size(folio));
+	struct bio_vec bv;
+	struct iov_iter iter;
+	int err = 0;
+
+	bvec_set_folio(&bv, folio, folio_size(folio), 0);
+	iov_iter_bvec(&iter, ITER_DEST, &bv, 1, folio_size(folio));
+	if (len) {
+		ssize_t ret = chunked_read_range(inode, pos, &iter, len);
+		if (ret != len)
+			err = ret < 0 ? ret : -EIO;
+	}
+	if (!err)
+		folio_zero_segment(folio, len, folio_size(folio));
+	folio_end_read(folio, !err);
+	return err;
+}
+
+/*
+ * Readahead for chunked files. ->readahead only takes the folios, a worker
+ * walks the list, sends all the chunks in the window to the disk, then
+ * copies them in and unlocks the folios as it goes. Nothing in here waits
+ * on the disk for whoever triggered it, which is what IOCB_NOWAIT and
+ * io_uring's async buffered reads need. The size of the window is left
+ * to the vfs.
+ */
+struct chunked_ra {
+	struct work_struct work;
+	struct inode *inode; //pinned by the locked folios
+	loff_t start;
+	loff_t end;
+	int nr_batches;
+	int nr_folios;
+	struct chunk_batch **batches;
+	ssize_t *batch_lens;
+	struct folio **folios;
+	struct bio_vec *bvecs;
+	size_t folio_bytes;
+};
+
+static void chunked_ra_free(struct chunked_ra *ra)
+{
+	kfree(ra->batches);
+	kfree(ra->batch_lens);
+	kfree(ra->folios);
+	kfree(ra->bvecs);
+	kfree(ra);
+}
+
+//returns where the batches that did get started end
+static loff_t chunked_ra_start(struct chunked_ra *ra)
+{
+	struct inode *inode = ra->inode;
+	struct super_block *sb = inode->i_sb;
+	struct chunk_entry chunks[CHUNK_READ_BATCH];
+	int max_batches = 0;
+	loff_t pos = ra->start;
+
+	while (pos < ra->end) {
+		loff_t found_pos = 0;
+		int nr = collect_chunks(inode, pos, ra->end, chunks,
+				    CHUNK_READ_BATCH, &found_pos);
+		if (WARN_ON(!nr))
+			break;
+		if (ra->nr_batches == max_batches) {
+			max_batches = max_batches ? 2 * max_batches : 4;
+			struct chunk_batch **batches = krealloc_array(ra->batches,
+					max_batches, sizeof(*batches), GFP_NOFS);
+			ssize_t *lens = krealloc_array(ra->batch_lens,
+					max_batches, sizeof(*lens), GFP_NOFS);
+			if (batches)
+				ra->batches = batches;
+			if (lens)
+				ra->batch_lens = lens;
+			if (!batches || !lens)
+				break;
+		}
+		struct chunk_batch *batch = chunk_read_batch_start(sb, chunks, nr,
+				pos - found_pos, ra->end - pos);
+		if (IS_ERR(batch))
+			break;
+		loff_t batch_end = found_pos;
+		for (int i = 0; i < nr; i++)
+			batch_end += chunks[i].size;
+		batch_end = min(batch_end, ra->end);
+		ra->batches[ra->nr_batches] = batch;
+		ra->batch_lens[ra->nr_batches++] = batch_end - pos;
+		pos = batch_end;
+	}
+	return pos;
+}
+
+static void chunked_ra_work(struct work_struct *work)
+{
+	struct chunked_ra *ra = container_of(work, struct chunked_ra, work);
+	struct super_block *sb = ra->inode->i_sb;
+	struct iov_iter iter;
+	size_t done = 0, unlocked = 0;
+	bool ok = true;
+	int i, f = 0;
+
+	//the folios past what got started just fail and get read again later
+	bool started_all = chunked_ra_start(ra) >= ra->end;
+
+	iov_iter_bvec(&iter, ITER_DEST, ra->bvecs, ra->nr_folios, ra->folio_bytes);
+	for (i = 0; i < ra->nr_batches; i++) {
+		//still has to be waited for and freed after a failure
+		ssize_t copied = chunk_read_batch_finish(sb, ra->batches[i], &iter);
+		if (!ok)
+			continue;
+		ok = copied == ra->batch_lens[i];
+		if (!ok)
+			continue;
+		done += copied;
+		while (ok && f < ra->nr_folios &&
+		       unlocked + folio_size(ra->folios[f]) <= done) {
+			unlocked += folio_size(ra->folios[f]);
+			folio_end_read(ra->folios[f++], true);
+		}
+	}
+	ok = ok && started_all;
+	//past the end of the file
+	if (ok && done < ra->folio_bytes)
+		iov_iter_zero(ra->folio_bytes - done, &iter);
+	while (f < ra->nr_folios)
+		folio_end_read(ra->folios[f++], ok);
+	chunked_ra_free(ra);
+}
+
+static void chunked_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	unsigned int nr_pages = readahead_count(rac);
+	struct chunked_ra *ra;
+	struct folio *folio;
+
+	//the caller unlocks the folios if we don't take them
+	ra = kzalloc(sizeof(*ra), GFP_NOFS);
+	if (!ra)
+		return;
+	INIT_WORK(&ra->work, chunked_ra_work);
+	ra->inode = inode;
+	ra->start = readahead_pos(rac);
+	ra->end = min_t(loff_t, ra->start + readahead_length(rac), i_size_read(inode));
+	ra->folios = kmalloc_array(nr_pages, sizeof(*ra->folios), GFP_NOFS);
+	ra->bvecs = kmalloc_array(nr_pages, sizeof(*ra->bvecs), GFP_NOFS);
+	if (!ra->folios || !ra->bvecs) {
+		chunked_ra_free(ra);
+		return;
+	}
+
+	while ((folio = readahead_folio(rac))) {
+		bvec_set_folio(&ra->bvecs[ra->nr_folios], folio, folio_size(folio), 0);
+		ra->folio_bytes += folio_size(folio);
+		ra->folios[ra->nr_folios++] = folio;
+	}
+	queue_work(system_unbound_wq, &ra->work);
+}
+
+const struct address_space_operations chunked_aops = {
+	.read_folio	= chunked_read_folio,
+	.readahead	= chunked_readahead,
+	//lets O_DIRECT opens through, chunked_direct_read does the work
+	.direct_IO	= noop_direct_IO,
+};
+
+static loff_t chunked_file_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(filp);
+
+	if (whence != SEEK_HOLE && whence != SEEK_DATA)
+		return generic_file_llseek(filp, offset, whence);
+	if (offset < 0 || offset >= inode->i_size)
+		return -ENXIO;
+	offset = ll_seek_hole_data(inode->i_sb, get_list_head(inode), offset,
+				   whence, inode->i_size);
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(filp, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Normal files can be chunked while someone has them open, and then the
+ * open file still has these ops. i_rwsem keeps the switch from happening
+ * in the middle of a read or write.
+ */
+static ssize_t cominix_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+	if (inode_is_chunked(inode)) {
+		//can't go back to being a normal file, so no need for the lock
+		inode_unlock_shared(inode);
+		return chunked_file_read_iter(iocb, to);
+	}
+	ret = generic_file_read_iter(iocb, to);
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+//same as above, chunked or not the folios come from the page cache
+static ssize_t cominix_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct inode *inode = file_inode(in);
+	ssize_t ret;
+
+	inode_lock_shared(inode);
+	ret = filemap_splice_read(in, ppos, pipe, len, flags);
+	inode_unlock_shared(inode);
 	return ret;
 }
 
+static ssize_t cominix_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+	if (inode_is_chunked(inode)) {
+		ret = -EPERM;
+		goto out;
+	}
+	//tells a chunker that's reading the file that it changed underneath it
+	cominix_i(inode)->i_write_gen++;
+	ret = generic_write_checks(iocb, from);
+	if (ret > 0)
+		ret = __generic_file_write_iter(iocb, from);
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
 
 //static int check_filp(struct file *filp)
 //{
@@ -68,14 +388,6 @@ chunked_file_read(struct file *filp,
 //	return 0;
 //}
 
-static void print_hash(char *digest)
-{
-	printk(KERN_INFO "hash: ");
-	for (int i = 0; i < 16; i++)
-		printk(KERN_CONT "%x ", digest[i]);
-	printk(KERN_CONT "\n");//flush
-}
-
 void dump_head(struct super_block *sb, block_t block)
 {
 #if 0
@@ -98,96 +410,440 @@ static void print_heap_info(struct super_block *sb)
 }
 
 
+struct chunk_list {
+	block_t head;
+	block_t end;
+	ssize_t size;
+};
+
+//how long a run of zeroes has to be before it's worth a hole
+#define ZERO_RUN_MIN CDC_MIN_SIZE
+
+static ssize_t zero_prefix(const char *buf, ssize_t len)
+{
+	const char *nonzero = memchr_inv(buf, 0, len);
+	return nonzero ? nonzero - buf : len;
+}
+
+/*
+ * Builds the chunk list for the file without holding any inode lock, so the
+ * file can still be read (and written, which makes us give up at the end).
+ *
+ * The file is read into a window of the largest chunk size and cdc runs
+ * over that. Runs of zeroes become holes and never reach the heap.
+ */
 static int
-chunk_and_replace(struct file *filp)
-{
-	struct super_block *sb = filp->f_inode->i_sb;
-
-	block_t head = ll_alloc_new_block(sb);
-	zero_out_block(sb, head);
-	block_t end = head;
-	ssize_t ll_size = 0;
-
-	ssize_t chunk_size = 0; 
-	filp->f_pos = 0;
-	while (filp->f_pos < filp->f_inode->i_size) {
-		chunk_size = cdc_get_chunk_size(filp, filp->f_pos);
-		if (WARN_ON(chunk_size < 0)){
-			printk("chunk_size was %ld\n", chunk_size);
-			return -1;
-		}
-		BUG_ON(chunk_size == 0);
-		//printk("DO YOU EVEN SEE ME?\n");
-		char *buf = kmalloc(chunk_size, GFP_KERNEL);
-		BUG_ON(!buf || IS_ERR(buf));
-		ssize_t read = 0;
-		ssize_t to_read = chunk_size;
-		ssize_t pos = 0;
-		while (to_read > 0) {
-			char *cursor = &buf[pos];
-			read = kernel_read(filp, cursor, chunk_size, &filp->f_pos);
-			if (read < 0) {
+chunk_file_to_list(struct file *filp, struct cominix_chunk_job *job,
+		   loff_t fsize, struct chunk_list *list)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	int dry_run = job->flags & COMINIX_CHUNK_DRY_RUN;
+	struct heap_extent ext;
+	int err = 0;
+
+	char *buf = kmalloc(CDC_MAX_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	chunk_extent_start(sb, &ext);
+	if (!dry_run) {
+		list->head = ll_alloc_new_block(sb);
+		zero_out_block(sb, list->head);
+		list->end = list->head;
+	}
+
+	struct blk_plug plug;
+	blk_start_plug(&plug);
+
+	//not filp->f_pos, the fd might belong to the user
+	loff_t read_pos = 0; //file offset of buf + buf_len
+	loff_t pos = 0;      //file offset of buf
+	ssize_t buf_len = 0;
+	blockoff_t run_end = 0; //where the last chunk's data ends in the heap
+	while (pos < fsize) {
+		ssize_t want = min_t(loff_t, fsize - pos, CDC_MAX_SIZE);
+		while (buf_len < want) {
+			ssize_t read = kernel_read(filp, buf + buf_len, want - buf_len, &read_pos);
+			if (read <= 0) {
 				printk("ERROR OF READ IS %ld\n", -read);
-				return -1;
+				err = read ? read : -EIO;
+				goto out;
+			}
+			buf_len += read;
+		}
+
+		ssize_t chunk_size;
+		ssize_t zeroes = zero_prefix(buf, buf_len);
+		bool hole = zeroes >= ZERO_RUN_MIN || zeroes == buf_len;
+		if (hole) {
+			chunk_size = zeroes;
+		} else {
+			chunk_size = cdc_get_chunk_size(buf, buf_len);
+			hole = zeroes >= chunk_size;
+		}
+		BUG_ON(chunk_size <= 0 || chunk_size > buf_len);
+
+		blockoff_t location = CHUNK_LOC_HOLE;
+		if (!hole) {
+			char digest[16] = {0};
+			int ret = md5_hash(buf, chunk_size, digest);
+			BUG_ON(ret);
+			struct chunk metadata = {
+				.hash = *(u64 *)digest, //throws away lower half
+				.length = (u32)chunk_size,
+				.refcount = 0,
+				.flags = 0,
+				.next = 0,
+			};
+			bool added = false;
+			//a dry run doesn't notice repeats inside the file itself
+			if (dry_run) {
+				added = !chunk_search_hashtable(sb, metadata.hash);
+			} else {
+				ext.left = fsize - pos;
+				location = chunk_find_or_fill(sb, &metadata, buf, &ext, &added);
+			}
+			if (added) {
+				job->nr_new_chunks++;
+				job->new_bytes += chunk_size;
 			}
-			to_read -= read;
-			pos += read;
+			job->nr_chunks++;
 		}
-		BUG_ON(pos != chunk_size);
-		char digest[16] = {0};
-		int ret = md5_hash(buf, chunk_size, digest);
-		BUG_ON(ret);
-		struct chunk metadata = {
-			.hash = *(u64 *)digest, //throws away lower half
-			.length = (u32)chunk_size,
-			.refcount = 0,
-			.flags = 0,
-			.next = 0,
-		};
-		blockoff_t location = chunk_search_hashtable(sb, metadata.hash);
-		if (location) {
-			printk("COLLISION");
-			print_hash(digest);
-		} else
-			location = chunk_fill_hashtable(sb, &metadata, buf);
+
+		pos += chunk_size;
+		buf_len -= chunk_size;
+		memmove(buf, buf + chunk_size, buf_len);
+		atomic64_set(&job->bytes_done, pos);
+		cond_resched();
+		if (dry_run)
+			continue;
 		BUG_ON(!location);
-		BUG_ON(!chunk_size);
 
-		ll_append(sb, &end, &ll_size, (struct chunk_entry){location, chunk_size});
-		dump_head(sb, end);
+		if (hole) {
+			ll_append_hole(sb, &list->end, &list->size, chunk_size);
+			run_end = 0;
+		} else {
+			ll_append_run(sb, &list->end, &list->size,
+				      (struct chunk_entry){location, chunk_size},
+				      location == run_end);
+			run_end = chunk_data_end(sb, location, chunk_size);
+		}
+		dump_head(sb, list->end);
+	}
+	BUG_ON(pos != fsize);
+out:
+	blk_finish_plug(&plug);
+	chunk_extent_release(sb, &ext);
+	//the list can't be given to the inode before its chunks are on disk
+	if (!dry_run) {
+		int write_err = chunk_wait_writes(sb, &ext);
+		if (!err)
+			err = write_err;
 	}
-	BUG_ON(filp->f_pos != filp->f_inode->i_size);
-	loff_t fsize = filp->f_inode->i_size;
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Swaps the normal file for the chunk list. Called with i_rwsem and the
+ * invalidate lock held, so no reads or writes are in the middle of the file.
+ */
+static void
+replace_with_list(struct inode *inode, struct chunk_list *list, loff_t fsize)
+{
+	struct super_block *sb = inode->i_sb;
 	print_heap_info(sb);
 
+	//the page cache has nothing the chunks don't, dirty or not
+	truncate_inode_pages(inode->i_mapping, 0);
 	//truncate doesn't mean remove all data, it means change to fit the f_size
 	//(increasing too)
-	filp->f_inode->i_size = 0; //IMPORTANT!!
-	cominix_truncate(filp->f_inode); 
-	filp->f_inode->i_size = fsize;
+	inode->i_size = 0; //IMPORTANT!!
+	cominix_truncate(inode); 
+	inode->i_size = fsize;
 
 	print_heap_info(sb);
-	switch_inode_to_chunked(filp->f_inode);
-	u32 *zones = i_data(filp->f_inode);
-
-	BUG_ON(head >= 1L << 32);
-	BUG_ON(ll_size >= 1L << 32);
-	BUG_ON(end >= 1L << 32);
-	zones[1] = (u32) head;
-	zones[2] = (u32) ll_size;
-	zones[3] = (u32) end;
+	switch_inode_to_chunked(inode);
+	u32 *zones = i_data(inode);
+
+	BUG_ON(list->head >= 1L << 32);
+	BUG_ON(list->size >= 1L << 32);
+	BUG_ON(list->end >= 1L << 32);
+	zones[1] = (u32) list->head;
+	zones[2] = (u32) list->size;
+	zones[3] = (u32) list->end;
 	
 	struct writeback_control wbc;
 	wbc.sync_mode = WB_SYNC_NONE;
-	int ret = cominix_write_inode(filp->f_inode, &wbc);
+	int ret = cominix_write_inode(inode, &wbc);
 	BUG_ON(ret);
 
 	//sets the file operations
-	cominix_set_inode(filp->f_inode, 0);
+	cominix_set_inode(inode, 0);
 
 	print_heap_info(sb);
-	return 0;
+}
+
+#define FINGERPRINT_BUF_SIZE (64 * 1024)
+
+/*
+ * md5 of the whole file, read in big pieces since there's no cdc to do.
+ * It's a second read for a file that isn't a duplicate, but a duplicate
+ * then costs no chunking at all.
+ */
+static int fingerprint_file(struct file *filp, loff_t fsize, u8 *digest)
+{
+	struct sdesc *md5;
+	loff_t pos = 0;
+	int err = 0;
+
+	char *buf = kmalloc(FINGERPRINT_BUF_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	md5 = md5_stream_start();
+	if (IS_ERR(md5)) {
+		kfree(buf);
+		return PTR_ERR(md5);
+	}
+	while (pos < fsize) {
+		size_t to_read = min_t(loff_t, fsize - pos, FINGERPRINT_BUF_SIZE);
+		ssize_t read = kernel_read(filp, buf, to_read, &pos);
+		if (read <= 0) {
+			err = read ? read : -EIO;
+			break;
+		}
+		err = md5_stream_update(md5, buf, read);
+		if (err)
+			break;
+		cond_resched();
+	}
+	if (md5_stream_end(md5, digest) && !err)
+		err = -EIO;
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Looks for a file with the same contents that was chunked before. The
+ * hashtable only keeps half the digest so the record has the rest.
+ */
+static bool find_fingerprint(struct super_block *sb, u8 *digest, loff_t fsize,
+			     struct chunk_list *list)
+{
+	struct file_fingerprint fp;
+	blockoff_t location;
+
+	location = chunk_search_hashtable_flags(sb, *(u64 *)digest, CHUNK_FLAG_FILE);
+	if (!location)
+		return false;
+	if (chunk_read_data(sb, location, &fp, sizeof(fp)))
+		return false;
+	if (memcmp(fp.digest, digest, sizeof(fp.digest)) || fp.size != fsize)
+		return false;
+	list->head = fp.head;
+	list->size = fp.list_size;
+	list->end = fp.end;
+	return true;
+}
+
+/*
+ * Only once the list belongs to an inode, so it's never freed after this.
+ * The bucket lock covers the search too, so two copies of a file chunked at
+ * the same time leave one record between them.
+ */
+static void add_fingerprint(struct super_block *sb, u8 *digest, loff_t fsize,
+			    struct chunk_list *list)
+{
+	struct file_fingerprint fp = {
+		.size = fsize,
+		.head = list->head,
+		.list_size = list->size,
+		.end = list->end,
+	};
+	struct chunk metadata = {
+		.hash = *(u64 *)digest,
+		.length = sizeof(fp),
+		.refcount = 0,
+		.flags = CHUNK_FLAG_FILE,
+		.next = 0,
+	};
+
+	bool added;
+
+	memcpy(fp.digest, digest, sizeof(fp.digest));
+	chunk_find_or_fill(sb, &metadata, (char *)&fp, NULL, &added);
+}
+
+static int check_chunkable(struct inode *inode)
+{
+	if (inode->i_fop == &cominix_file_operations && !inode_is_chunked(inode))
+		return 0;
+	if (inode->i_fop == &chunked_file_operations) {
+		printk("File has already been chunked.\n");
+		return -EALREADY;
+	}
+	printk("ERROR?! Unknown file ops pointer.\n");
+	return -EINVAL;
+}
+
+int cominix_chunk_file(struct file *filp, struct cominix_chunk_job *job)
+{
+	struct inode *inode = file_inode(filp);
+	struct address_space *mapping = inode->i_mapping;
+	struct chunk_list list = {};
+	loff_t fsize;
+	u32 write_gen;
+	u8 digest[16];
+	bool shared = false;
+	int err = 0;
+
+	if (!S_ISREG(inode->i_mode)) {
+		printk("Attempted to chunk non-file. (Was it a directory?)\n");
+		return -EINVAL;
+	}
+	//new chunks only go in the split layout, see cminix_fill_extra_super
+	if (cominix_sb(inode->i_sb)->chunk_layout != CHUNK_LAYOUT_SPLIT) {
+		printk("The heap uses the old inline layout, can't chunk into it.\n");
+		return -EOPNOTSUPP;
+	}
+	inode_lock_shared(inode);
+	err = check_chunkable(inode);
+	fsize = inode->i_size;
+	write_gen = cominix_i(inode)->i_write_gen;
+	inode_unlock_shared(inode);
+	if (err)
+		goto out;
+
+	job->bytes_total = fsize;
+	err = fingerprint_file(filp, fsize, digest);
+	if (err)
+		goto out;
+	shared = find_fingerprint(inode->i_sb, digest, fsize, &list);
+	if (shared) {
+		//same contents as a file chunked before, take its list
+		job->nr_chunks = list.size;
+		atomic64_set(&job->bytes_done, fsize);
+		if (job->flags & COMINIX_CHUNK_DRY_RUN)
+			goto out;
+	} else {
+		err = chunk_file_to_list(filp, job, fsize, &list);
+		if (err || (job->flags & COMINIX_CHUNK_DRY_RUN))
+			goto out_free;
+	}
+
+	inode_lock(inode);
+	filemap_invalidate_lock(mapping);
+	err = check_chunkable(inode);
+	if (!err && (cominix_i(inode)->i_write_gen != write_gen ||
+		     inode->i_size != fsize)) {
+		printk("File changed while it was being chunked. Giving up.\n");
+		err = -EAGAIN;
+	}
+	if (!err)
+		replace_with_list(inode, &list, fsize);
+	filemap_invalidate_unlock(mapping);
+	inode_unlock(inode);
+	if (!err) {
+		if (!shared)
+			add_fingerprint(inode->i_sb, digest, fsize, &list);
+		goto out;
+	}
+out_free:
+	//the chunks stay in the heap, like the chunks of a deleted file
+	if (list.head && !shared)
+		ll_free(inode->i_sb, list.head);
+out:
+	return err;
+}
+
+/*
+ * Makes dst a chunked file with the same chunk list as src. Lists are never
+ * changed or freed once they belong to an inode, so both can point at it.
+ * *len ends up as what was cloned, the way the vfs wants it back.
+ */
+static int share_chunk_list(struct file *file_in, struct file *file_out,
+			    loff_t *len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	loff_t fsize;
+	int err;
+
+	lock_two_nondirectories(src, dst);
+	filemap_invalidate_lock(dst->i_mapping);
+	//immutable and swap files, and writes back what's dirty in both
+	err = generic_remap_file_range_prep(file_in, 0, file_out, 0, len, remap_flags);
+	if (err || !*len)
+		goto out;
+	err = check_chunkable(dst);
+	//already chunked just means we can't do it, not that anything's wrong
+	if (err == -EALREADY)
+		err = -EOPNOTSUPP;
+	if (err)
+		goto out;
+	//the list is all of src, and anything past the end of src would have to be kept
+	fsize = src->i_size;
+	if (*len != fsize || dst->i_size > fsize) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	u32 *zones = i_data(src);
+	struct chunk_list list = {
+		.head = zones[1],
+		.size = zones[2],
+		.end = zones[3],
+	};
+	//makes a chunker that's reading dst give up
+	cominix_i(dst)->i_write_gen++;
+	replace_with_list(dst, &list, fsize);
+	inode_set_mtime_to_ts(dst, inode_set_ctime_current(dst));
+	mark_inode_dirty(dst);
+out:
+	filemap_invalidate_unlock(dst->i_mapping);
+	unlock_two_nondirectories(src, dst);
+	return err;
+}
+
+/* only whole chunked files can be cloned, into a file that's no larger */
+static bool can_share_chunk_list(struct file *file_in, loff_t pos_in,
+				 struct file *file_out, loff_t pos_out, loff_t len)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+
+	if (src->i_sb != dst->i_sb || src == dst)
+		return false;
+	if (!inode_is_chunked(src) || !S_ISREG(dst->i_mode))
+		return false;
+	//len 0 means "to the end" for FICLONE
+	return pos_in == 0 && pos_out == 0 && (len == 0 || len >= src->i_size);
+}
+
+static loff_t cominix_remap_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, loff_t len,
+		unsigned int remap_flags)
+{
+	int err;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return -EOPNOTSUPP;
+	if (!can_share_chunk_list(file_in, pos_in, file_out, pos_out, len))
+		return -EOPNOTSUPP;
+	err = share_chunk_list(file_in, file_out, &len, remap_flags);
+	return err ? err : len;
+}
 
+/*
+ * Never shares the list, cp uses this and would end up with a chunked (so
+ * read only) copy it didn't ask for. Sharing is only for FICLONE. Without
+ * this the vfs would try remap_file_range for us.
+ */
+static ssize_t cominix_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	return splice_copy_file_range(file_in, pos_in, file_out, pos_out, len);
 }
 
 static ssize_t fail_write (struct file *filp, 
@@ -215,19 +871,65 @@ static ssize_t fail_write (struct file *filp,
 	return err;
 }
 
-const struct inode_operations cominix_file_inode_operations = {};
+/*
+ * A truncate that grows the file back to the same size would look like
+ * nothing happened to a chunker that's reading it, so size changes bump
+ * i_write_gen too (in cominix_truncate).
+ */
+static int cominix_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+			   struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	err = setattr_prepare(&nop_mnt_idmap, dentry, attr);
+	if (err)
+		return err;
+
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+		//the list can be shared, it doesn't get cut or grown
+		if (inode_is_chunked(inode))
+			return -EPERM;
+		err = inode_newsize_ok(inode, attr->ia_size);
+		if (err)
+			return err;
+		truncate_setsize(inode, attr->ia_size);
+		cominix_truncate(inode);
+	}
+
+	setattr_copy(&nop_mnt_idmap, inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+const struct inode_operations cominix_file_inode_operations = {
+	.setattr	= cominix_setattr,
+};
 const struct file_operations cominix_file_operations = {
 	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter, 
-	.write_iter	= generic_file_write_iter, //change this to check and write?
+	.read_iter	= cominix_file_read_iter,
+	.write_iter	= cominix_file_write_iter,
 	//.mmap		= generic_file_mmap, //same?
 	.fsync		= generic_file_fsync,
-	//.splice_read	= filemap_splice_read,
+	.splice_read	= cominix_file_splice_read,
+	.unlocked_ioctl	= cominix_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.remap_file_range = cominix_remap_file_range,
+	.copy_file_range = cominix_copy_file_range,
 };
 const struct file_operations chunked_file_operations = {
-	.llseek		= generic_file_llseek,
-	.read		= chunked_file_read,
+	.open		= chunked_file_open,
+	.llseek		= chunked_file_llseek,
+	.read_iter	= chunked_file_read_iter,
+	//faults go through chunked_aops, the pages are never dirty
+	.mmap		= generic_file_readonly_mmap,
+	.splice_read	= filemap_splice_read,
 	//.write		= fail_write,
+	.unlocked_ioctl	= cominix_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.remap_file_range = cominix_remap_file_range,
+	.copy_file_range = cominix_copy_file_range,
+	.fop_flags	= FOP_BUFFER_RASYNC,
 };
 
 #include <linux/proc_fs.h>
@@ -266,27 +968,13 @@ ssize_t cminix_proc_write(struct file *proc_file,
 		printk("(Other file system is %s)\n", filp->f_inode->i_sb->s_type->name);
 		goto general_err;
 	}
-	if (!S_ISREG(filp->f_inode->i_mode)) {
-		printk("Attempted to chunk non-file. (Was it a directory?)\n");
-		goto general_err;
-	}
-	inode_lock(filp->f_inode);
-	if (filp->f_inode->i_fop != &cominix_file_operations) {
-		if (filp->f_inode->i_fop == &chunked_file_operations)
-			printk("'%s' has already been chunked.\n", buf_copy);
-		else
-			printk("ERROR?! Unknown file ops pointer.\n");
-
-		inode_unlock(filp->f_inode);
-		goto general_err;
-	}
 	printk("Proceeding with chunking '%s'.\n", buf_copy);
+	ret = cominix_chunk_submit(filp, 0);
+	if (ret)
+		printk("Chunking '%s' failed (%d).\n", buf_copy, ret);
 	kfree(buf_copy);
-	chunk_and_replace(filp);
-	inode_unlock(filp->f_inode);
-
 	filp_close(filp, NULL);
-	return count;
+	return ret ? ret : count;
 general_err:
 	filp_close(filp, NULL);
 open_err:
@@ -19,8 +19,10 @@
 #include <linux/init.h>
 #include <linux/highuid.h>
 #include <linux/mpage.h>
+#include <linux/pagevec.h>
 #include <linux/vfs.h>
 #include <linux/writeback.h>
+#include <linux/shrinker.h>
 
 typedef u32 block_t;
 struct buffer_head *load_block(struct super_block *sb, block_t block)
@@ -42,6 +44,10 @@ static void cominix_evict_inode(struct inode *inode)
 		cominix_truncate(inode);
 	}
 	invalidate_inode_buffers(inode);
+	kfree(cominix_i(inode)->i_chunk_job);
+	kfree(cominix_i(inode)->i_ext_index);
+	cominix_i(inode)->i_ext_index = NULL;
+	cached_list_drop(inode);
 	clear_inode(inode);
 	if (!inode->i_nlink)
 		cominix_free_inode(inode);
@@ -52,6 +58,9 @@ static void cominix_put_super(struct super_block *sb)
 	int i;
 	struct cominix_sb_info *sbi = cominix_sb(sb);
 
+	chunk_wait_all_writes(sb);
+	cached_list_exit_sb(sb);
+	chunk_cache_exit(sb);
 	if (!sb_rdonly(sb)) {
 		if (sbi->s_version != MINIX_V3)	 /* s_state is now out from V3 sb */
 			sbi->s_ms->s_state = sbi->s_mount_state;
@@ -63,6 +72,7 @@ static void cominix_put_super(struct super_block *sb)
 		brelse(sbi->s_zmap[i]);
 	brelse (sbi->s_sbh);
 	kfree(sbi->s_imap);
+	cominix_destroy_free_counts(sb);
 	sb->s_fs_info = NULL;
 	kfree(sbi);
 }
@@ -75,6 +85,14 @@ static struct inode *cominix_alloc_inode(struct super_block *sb)
 	ei = alloc_inode_sb(sb, cominix_inode_cachep, GFP_KERNEL);
 	if (!ei)
 		return NULL;
+	ei->i_chunk_job = NULL;
+	ei->i_write_gen = 0;
+	ei->i_alloc_goal = 0;
+	init_rwsem(&ei->i_ext_sem);
+	ei->i_ext_stale = U32_MAX;
+	ei->i_ext_index = NULL;
+	RCU_INIT_POINTER(ei->i_cached_list, NULL);
+	INIT_LIST_HEAD(&ei->i_cached_lru);
 	return &ei->vfs_inode;
 }
 
@@ -201,6 +219,7 @@ static int cminix_alloc_extra_super(struct super_block *sb, struct buffer_head *
 	esb->hashtable_location = sbi->hashtable;
 	esb->hashtable_size = sbi->hashtable_size;
 	esb->heap_brk = sbi->heap_brk;
+	esb->chunk_layout = CHUNK_LAYOUT_SPLIT;
 
 	struct cominix3_super_block *m3s = (void*)sb_bh->b_data;
 	m3s->s_pad0 = esb_loc & ((1 << 16) - 1);
@@ -224,7 +243,9 @@ static int cminix_fill_extra_super(struct super_block *sb)
 	if (!esb_loc) {
 		sbi->hashtable = 40LL << 20;
 		sbi->hashtable_size = 32LL << 10;
-		sbi->heap_brk = sbi->hashtable + sbi->hashtable_size;
+		sbi->chunk_layout = CHUNK_LAYOUT_SPLIT;
+		chunk_layout_init(sb);
+		sbi->heap_brk = sbi->heap_start;
 
 		brelse(bh);
 		return 0;
@@ -240,6 +261,29 @@ static int cminix_fill_extra_super(struct super_block *sb)
 	sbi->heap_brk = esb->heap_brk;
 	printk("hashtable break is %lld kb\n", esb->heap_brk >> 10);
 	printk("heap size is %lld kb\n", (esb->heap_brk - esb->hashtable_location - esb->hashtable_size)>> 10);
+	sbi->chunk_layout = esb->chunk_layout;
+	if (sbi->chunk_layout != CHUNK_LAYOUT_INLINE &&
+	    sbi->chunk_layout != CHUNK_LAYOUT_SPLIT) {
+		printk("CMINIX: unknown chunk layout %u.\n", sbi->chunk_layout);
+		brelse(bh);
+		return -EINVAL;
+	}
+	//nothing was ever chunked so there's nothing to keep the old layout for
+	if (sbi->chunk_layout == CHUNK_LAYOUT_INLINE && !sb_rdonly(sb) &&
+	    esb->heap_brk == sbi->hashtable + sbi->hashtable_size) {
+		printk("Switching the empty heap to the split chunk layout.\n");
+		sbi->chunk_layout = CHUNK_LAYOUT_SPLIT;
+		chunk_layout_init(sb);
+		sbi->heap_brk = sbi->heap_start;
+		esb->heap_brk = sbi->heap_brk;
+		esb->chunk_layout = CHUNK_LAYOUT_SPLIT;
+		mark_buffer_dirty(bh);
+	} else {
+		chunk_layout_init(sb);
+	}
+	//the chunks can't be moved, so they're read where they are
+	if (sbi->chunk_layout == CHUNK_LAYOUT_INLINE)
+		printk("CMINIX: chunks use the old inline layout, no more files can be chunked.\n");
 	brelse(bh);
 	return 0;
 	
@@ -260,6 +304,21 @@ static int cominix_fill_super(struct super_block *s, void *data, int silent)
 	if (!sbi)
 		return -ENOMEM;
 	s->s_fs_info = sbi;
+	init_waitqueue_head(&sbi->heap_write_wq);
+	spin_lock_init(&sbi->heap_write_lock);
+	INIT_LIST_HEAD(&sbi->heap_writes);
+	init_llist_head(&sbi->heap_failed_writes);
+	spin_lock_init(&sbi->bitmap_lock);
+	rwlock_init(&sbi->pointers_lock);
+	mutex_init(&sbi->brk_lock);
+	for (i = 0; i < CHUNK_BUCKET_LOCKS; i++)
+		mutex_init(&sbi->bucket_locks[i]);
+	ret = cached_list_init_sb(s);
+	if (!ret)
+		ret = chunk_cache_init(s);
+	if (ret)
+		goto out;
+	ret = -EINVAL;
 
 	BUILD_BUG_ON(32 != sizeof (struct cominix_inode));
 	BUILD_BUG_ON(64 != sizeof(struct cominix2_inode));
@@ -317,12 +376,12 @@ static int cominix_fill_super(struct super_block *s, void *data, int silent)
 		alloc_new_esb = true;
 	}
 
+	//nzones is the total number of blocks on the whole disk
+	sbi->max_brk = sbi->s_nzones * s->s_blocksize;
 	ret = cminix_fill_extra_super(s);
 	if (ret)
 		goto out_illegal_sb;
 	u64 new_nzones = sbi->hashtable >> s->s_blocksize_bits;
-	//nzones is the total number of blocks on the whole disk
-	sbi->max_brk = sbi->s_nzones * s->s_blocksize;
 	BUG_ON(new_nzones > sbi->s_nzones);
 	sbi->s_nzones = new_nzones;
 
@@ -371,6 +430,9 @@ static int cominix_fill_super(struct super_block *s, void *data, int silent)
 		goto out_no_bitmap;
 	}
 
+	if (cominix_init_free_counts(s))
+		goto out_freemap;
+
 	/* set up enough so that it can read an inode */
 	s->s_op = &cominix_sops;
 	s->s_time_min = 0;
@@ -406,6 +468,7 @@ static int cominix_fill_super(struct super_block *s, void *data, int silent)
 out_no_root:
 	if (!silent)
 		printk("MINIX-fs: get root inode failed\n");
+	cominix_destroy_free_counts(s);
 	goto out_freemap;
 
 out_no_bitmap:
@@ -444,6 +507,8 @@ out_bad_hblock:
 out_bad_sb:
 	printk("MINIX-fs: unable to read superblock\n");
 out:
+	shrinker_free(sbi->cached_list_shrinker);
+	chunk_cache_exit(s);
 	s->s_fs_info = NULL;
 	kfree(sbi);
 	return ret;
@@ -470,6 +535,8 @@ static int cominix_statfs(struct dentry *dentry, struct kstatfs *buf)
 static int cominix_get_block(struct inode *inode, sector_t block,
 		    struct buffer_head *bh_result, int create)
 {
+	if (inode_is_extent(inode))
+		return cominix_extent_get_block(inode, block, bh_result, create);
 	return V2_cominix_get_block(inode, block, bh_result, create);
 }
 
@@ -491,6 +558,11 @@ static int cominix_read_folio(struct file *file, struct folio *folio)
 	return block_read_full_folio(folio, cominix_get_block);
 }
 
+static void cominix_readahead(struct readahead_control *rac)
+{
+	mpage_readahead(rac, cominix_get_block);
+}
+
 int cominix_prepare_chunk(struct folio *folio, loff_t pos, unsigned len)
 {
 	return __block_write_begin(folio, pos, len, cominix_get_block);
@@ -519,6 +591,205 @@ static int cominix_write_begin(struct file *file, struct address_space *mapping,
 	return ret;
 }
 
+/*
+ * Regular files use delayed allocation: write_begin only reserves a block
+ * and the buffer is marked delay, writeback picks the real block. A file
+ * that gets chunked (or deleted) before writeback never touches the disk
+ * area for normal files at all.
+ */
+#define DELAYED_BLOCK (~(sector_t)0)
+
+static int cominix_da_get_block(struct inode *inode, sector_t block,
+		    struct buffer_head *bh_result, int create)
+{
+	int err = cominix_get_block(inode, block, bh_result, 0);
+
+	if (err || buffer_mapped(bh_result) || !create)
+		return err;
+	err = cominix_reserve_block(inode->i_sb);
+	if (err)
+		return err;
+	map_bh(bh_result, inode->i_sb, DELAYED_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+//writeback of a delayed buffer, the reservation turns into a real block
+static int cominix_wb_get_block(struct inode *inode, sector_t block,
+		    struct buffer_head *bh_result, int create)
+{
+	bool delayed = buffer_delay(bh_result);
+	int err = cominix_get_block(inode, block, bh_result, create);
+
+	if (!err && delayed)
+		cominix_release_blocks(inode->i_sb, 1);
+	return err;
+}
+
+/*
+ * The longest a run can get: the rest of the folio being written and a
+ * batch of the ones after it.
+ */
+#define DA_RUN_FOLIOS PAGEVEC_SIZE
+
+//adds the delayed buffers from bh to the end of its folio, false if one wasn't
+static bool collect_delayed(struct buffer_head *bh, struct buffer_head *head,
+			    struct buffer_head **run, int *n, int max)
+{
+	do {
+		if (*n == max || !buffer_delay(bh) || !buffer_dirty(bh))
+			return false;
+		run[(*n)++] = bh;
+	} while ((bh = bh->b_this_page) != head);
+	return true;
+}
+
+/*
+ * block_write_full_folio asks get_block for one block at a time, which
+ * would give every delayed buffer its own allocation. So before a folio is
+ * written, the delayed buffers from first on (and on into the folios after
+ * it, for as long as they stay delayed) are mapped with one get_block that
+ * asks for all of them, the way ext4 maps an extent before submitting it.
+ *
+ * The later folios are only trylocked, in index order, so the run just
+ * stops at a folio someone else holds. Whatever doesn't get mapped here
+ * goes through cominix_wb_get_block one buffer at a time as before.
+ */
+static void cominix_da_map_run(struct inode *inode, struct folio *folio,
+			       struct buffer_head *first)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int bits = inode->i_blkbits;
+	loff_t size = i_size_read(inode);
+	int max = (DA_RUN_FOLIOS + 1) << (PAGE_SHIFT - bits);
+	sector_t start = (folio_pos(folio) + bh_offset(first)) >> bits;
+	struct folio *folios[DA_RUN_FOLIOS];
+	struct buffer_head **run;
+	int nr_folios = 0, n = 0, done = 0, i;
+	pgoff_t index = folio->index;
+
+	run = kmalloc_array(max, sizeof(*run), GFP_NOFS);
+	if (!run)
+		return;
+	if (collect_delayed(first, folio_buffers(folio), run, &n, max)) {
+		while (nr_folios < DA_RUN_FOLIOS) {
+			struct folio *next = __filemap_get_folio(inode->i_mapping, ++index,
+						FGP_LOCK | FGP_NOWAIT, 0);
+			struct buffer_head *head;
+			bool whole;
+			int had = n;
+
+			if (IS_ERR(next))
+				break;
+			head = folio_buffers(next);
+			whole = head && collect_delayed(head, head, run, &n, max);
+			if (n == had) {
+				folio_unlock(next);
+				folio_put(next);
+				break;
+			}
+			folios[nr_folios++] = next;
+			if (!whole)
+				break;
+		}
+	}
+	//block_write_full_folio skips what's past the end of the file
+	if (size <= (loff_t)start << bits)
+		n = 0;
+	else
+		n = min_t(sector_t, n, DIV_ROUND_UP(size, 1 << bits) - start);
+
+	while (done < n) {
+		struct buffer_head map = {};
+		int got;
+
+		//the data was reserved, what get_block needs besides comes from the margin
+		set_buffer_delay(&map);
+		map.b_size = (size_t)(n - done) << bits;
+		if (cominix_get_block(inode, start + done, &map, 1) || !buffer_mapped(&map))
+			break;
+		got = min_t(int, map.b_size >> bits, n - done);
+		if (buffer_new(&map))
+			clean_bdev_aliases(sb->s_bdev, map.b_blocknr, got);
+		for (i = 0; i < got; i++) {
+			clear_buffer_delay(run[done + i]);
+			map_bh(run[done + i], sb, map.b_blocknr + i);
+		}
+		cominix_release_blocks(sb, got);
+		done += got;
+	}
+
+	for (i = 0; i < nr_folios; i++) {
+		folio_unlock(folios[i]);
+		folio_put(folios[i]);
+	}
+	kfree(run);
+}
+
+static int cominix_da_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	struct folio *folio = NULL;
+	struct blk_plug plug;
+	int error = 0;
+
+	//mpage would take the delayed buffers as mapped, so it's a folio at a time
+	blk_start_plug(&plug);
+	while ((folio = writeback_iter(mapping, wbc, folio, &error))) {
+		struct buffer_head *head = folio_buffers(folio), *bh = head;
+
+		if (head) {
+			do {
+				//after a run, only a buffer it didn't reach is still delayed
+				if (buffer_delay(bh) && buffer_dirty(bh))
+					cominix_da_map_run(mapping->host, folio, bh);
+			} while ((bh = bh->b_this_page) != head);
+		}
+		error = block_write_full_folio(folio, wbc, cominix_wb_get_block);
+	}
+	blk_finish_plug(&plug);
+	return error;
+}
+
+static void cominix_da_invalidate_folio(struct folio *folio, size_t offset,
+		size_t length)
+{
+	struct buffer_head *head = folio_buffers(folio), *bh;
+	size_t start = 0, stop = offset + length;
+	int released = 0;
+
+	if (head) {
+		bh = head;
+		do {
+			size_t next = start + bh->b_size;
+			if (next > stop)
+				break;
+			if (start >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				released++;
+			}
+			start = next;
+		} while ((bh = bh->b_this_page) != head);
+		if (released)
+			cominix_release_blocks(folio->mapping->host->i_sb, released);
+	}
+	block_invalidate_folio(folio, offset, length);
+}
+
+static int cominix_da_write_begin(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len,
+			struct folio **foliop, void **fsdata)
+{
+	int ret;
+
+	ret = block_write_begin(mapping, pos, len, foliop, cominix_da_get_block);
+	if (unlikely(ret))
+		cominix_write_failed(mapping, pos + len);
+
+	return ret;
+}
+
 static sector_t cominix_bmap(struct address_space *mapping, sector_t block)
 {
 	return generic_block_bmap(mapping,block,cominix_get_block);
@@ -528,6 +799,7 @@ static const struct address_space_operations cominix_aops = {
 	.dirty_folio	= block_dirty_folio,
 	.invalidate_folio = block_invalidate_folio,
 	.read_folio = cominix_read_folio,
+	.readahead = cominix_readahead,
 	.writepages = cominix_writepages,
 	.write_begin = cominix_write_begin,
 	.write_end = generic_write_end,
@@ -536,6 +808,19 @@ static const struct address_space_operations cominix_aops = {
 	.direct_IO = noop_direct_IO
 };
 
+static const struct address_space_operations cominix_file_aops = {
+	.dirty_folio	= block_dirty_folio,
+	.invalidate_folio = cominix_da_invalidate_folio,
+	.read_folio = cominix_read_folio,
+	.readahead = cominix_readahead,
+	.writepages = cominix_da_writepages,
+	.write_begin = cominix_da_write_begin,
+	.write_end = generic_write_end,
+	.migrate_folio = buffer_migrate_folio,
+	.bmap = cominix_bmap,
+	.direct_IO = noop_direct_IO
+};
+
 static const struct inode_operations cominix_symlink_inode_operations = {
 	.get_link	= page_get_link,
 	.getattr	= cominix_getattr,
@@ -546,10 +831,10 @@ void cominix_set_inode(struct inode *inode, dev_t rdev)
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &cominix_file_inode_operations;
 		inode->i_fop = &cominix_file_operations;
-		inode->i_mapping->a_ops = &cominix_aops;
+		inode->i_mapping->a_ops = &cominix_file_aops;
 		if (inode_is_chunked(inode)) {
 			inode->i_fop = &chunked_file_operations;
-			inode->i_mapping->a_ops = &empty_aops;
+			inode->i_mapping->a_ops = &chunked_aops;
 		}
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &cominix_dir_inode_operations;
@@ -672,9 +957,13 @@ int cominix_getattr(struct mnt_idmap *idmap, const struct path *path,
 {
 	struct super_block *sb = path->dentry->d_sb;
 	struct inode *inode = d_inode(path->dentry);
+	u64 blocks;
 
 	generic_fillattr(&nop_mnt_idmap, request_mask, inode, stat);
-	stat->blocks = (sb->s_blocksize / 512) * V2_cominix_blocks(stat->size, sb);
+	//an extent file can have holes, so its size says nothing
+	if (!inode_is_extent(inode) || cominix_extent_blocks(inode, &blocks))
+		blocks = V2_cominix_blocks(stat->size, sb);
+	stat->blocks = (sb->s_blocksize / 512) * blocks;
 	stat->blksize = sb->s_blocksize;
 	return 0;
 }
@@ -692,12 +981,20 @@ void cominix_truncate(struct inode * inode)
 		/* if the size decreases then I'm already kind of handling that with the pos,
 		except that the read might return a little bit more, but its an odd edge case
 		that I'm not worried about. */
+		/* the list can be shared with clones, so it would
+		need a refcount before it could be freed here */
 		WARN_ON(inode->i_size);
 		printk("Chunked inode is being removed. TODO: delete the linked list in the node.\n");
 		return;
 	}
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)))
 		return;
+	//same as a write for a chunker that's reading the file
+	cominix_i(inode)->i_write_gen++;
+	if (inode_is_extent(inode)) {
+		cominix_extent_truncate(inode);
+		return;
+	}
 	V2_cominix_truncate(inode);
 }
 
@@ -744,10 +1041,15 @@ static int __init init_cominix_fs(void)
 	int err = init_inodecache();
 	if (err)
 		goto out1;
-	err = register_filesystem(&cominix_fs_type);
+	err = cominix_chunk_init();
 	if (err)
 		goto out;
+	err = register_filesystem(&cominix_fs_type);
+	if (err)
+		goto out_chunk;
 	return 0;
+out_chunk:
+	cominix_chunk_exit();
 out:
 	destroy_inodecache();
 out1:
@@ -758,6 +1060,7 @@ static void __exit exit_cominix_fs(void)
 {
 	cminix_proc_clean();
         unregister_filesystem(&cominix_fs_type);
+	cominix_chunk_exit();
 	destroy_inodecache();
 }
 
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ioctls for cominix files, and the queue of chunking jobs behind them.
+ *
+ * FS_IOC_COMINIX_CHUNK does the same thing as writing a path to
+ * /proc/fs/cominix/chunker, but on a file that is already open and
+ * optionally in the background. FS_IOC_COMINIX_CHUNK_STATUS reads back
+ * how far the last job on that file got.
+ */
+
+#include "cominix.h"
+#include "cominix_ioctl.h"
+#include <linux/mount.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+
+static struct workqueue_struct *chunk_wq;
+static struct workqueue_struct *chunk_hipri_wq;
+
+static void set_job_state(struct cominix_chunk_job *job, u32 state, int error)
+{
+	struct inode *inode = file_inode(job->filp);
+
+	spin_lock(&inode->i_lock);
+	job->state = state;
+	job->error = error;
+	spin_unlock(&inode->i_lock);
+}
+
+/* the job (and maybe the inode) can be gone once this returns */
+static int run_chunk_job(struct cominix_chunk_job *job)
+{
+	struct file *filp = job->filp;
+	int err;
+
+	set_job_state(job, COMINIX_CHUNK_RUNNING, 0);
+	err = cominix_chunk_file(filp, job);
+	set_job_state(job, COMINIX_CHUNK_DONE, err);
+
+	mnt_drop_write_file(filp);
+	fput(filp);
+	return err;
+}
+
+static void chunk_job_work(struct work_struct *work)
+{
+	run_chunk_job(container_of(work, struct cominix_chunk_job, work));
+}
+
+int cominix_chunk_submit(struct file *filp, u32 flags)
+{
+	struct inode *inode = file_inode(filp);
+	struct cominix_inode_info *ci = cominix_i(inode);
+	struct cominix_chunk_job *job, *old;
+	int err;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	INIT_WORK(&job->work, chunk_job_work);
+	job->flags = flags;
+	job->state = COMINIX_CHUNK_QUEUED;
+	job->bytes_total = i_size_read(inode);
+
+	err = mnt_want_write_file(filp);
+	if (err) {
+		kfree(job);
+		return err;
+	}
+	job->filp = get_file(filp);
+
+	spin_lock(&inode->i_lock);
+	old = ci->i_chunk_job;
+	if (old && old->state != COMINIX_CHUNK_DONE) {
+		spin_unlock(&inode->i_lock);
+		mnt_drop_write_file(filp);
+		fput(filp);
+		kfree(job);
+		return -EBUSY;
+	}
+	ci->i_chunk_job = job;
+	spin_unlock(&inode->i_lock);
+	kfree(old);
+
+	if (!(flags & COMINIX_CHUNK_ASYNC))
+		return run_chunk_job(job);
+
+	if (flags & COMINIX_CHUNK_PRIORITY)
+		queue_work(chunk_hipri_wq, &job->work);
+	else
+		queue_work(chunk_wq, &job->work);
+	return 0;
+}
+
+static long ioctl_chunk(struct file *filp, void __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct cominix_chunk_args args;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (args.flags & ~COMINIX_CHUNK_FLAGS)
+		return -EINVAL;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	//we read the file through this fd
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!inode_owner_or_capable(file_mnt_idmap(filp), inode))
+		return -EPERM;
+
+	return cominix_chunk_submit(filp, args.flags);
+}
+
+static long ioctl_chunk_status(struct file *filp, void __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct cominix_chunk_job *job;
+	struct cominix_chunk_status st = {};
+
+	spin_lock(&inode->i_lock);
+	job = cominix_i(inode)->i_chunk_job;
+	if (job) {
+		st.state = job->state;
+		st.error = job->error;
+		st.flags = job->flags;
+		st.bytes_done = atomic64_read(&job->bytes_done);
+		st.bytes_total = job->bytes_total;
+		st.nr_chunks = job->nr_chunks;
+		st.nr_new_chunks = job->nr_new_chunks;
+		st.new_bytes = job->new_bytes;
+	}
+	spin_unlock(&inode->i_lock);
+
+	if (copy_to_user(arg, &st, sizeof(st)))
+		return -EFAULT;
+	return 0;
+}
+
+long cominix_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FS_IOC_COMINIX_CHUNK:
+		return ioctl_chunk(filp, (void __user *)arg);
+	case FS_IOC_COMINIX_CHUNK_STATUS:
+		return ioctl_chunk_status(filp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+int __init cominix_chunk_init(void)
+{
+	chunk_wq = alloc_workqueue("cominix_chunk", WQ_UNBOUND, 0);
+	if (!chunk_wq)
+		return -ENOMEM;
+	chunk_hipri_wq = alloc_workqueue("cominix_chunk_hi",
+					 WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!chunk_hipri_wq) {
+		destroy_workqueue(chunk_wq);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void cominix_chunk_exit(void)
+{
+	destroy_workqueue(chunk_hipri_wq);
+	destroy_workqueue(chunk_wq);
+}
@@ -7,7 +7,10 @@ typedef struct {
 	struct buffer_head *bh;
 } Indirect;
 
-static DEFINE_RWLOCK(pointers_lock);
+static inline rwlock_t *pointers_lock(struct inode *inode)
+{
+	return &cominix_sb(inode->i_sb)->pointers_lock;
+}
 
 static inline void add_chain(Indirect *p, struct buffer_head *bh, block_t *v)
 {
@@ -46,18 +49,18 @@ static inline Indirect *get_branch(struct inode *inode,
 		bh = sb_bread(sb, block_to_cpu(p->key));
 		if (!bh)
 			goto failure;
-		read_lock(&pointers_lock);
+		read_lock(pointers_lock(inode));
 		if (!verify_chain(chain, p))
 			goto changed;
 		add_chain(++p, bh, (block_t *)bh->b_data + *++offsets);
-		read_unlock(&pointers_lock);
+		read_unlock(pointers_lock(inode));
 		if (!p->key)
 			goto no_block;
 	}
 	return NULL;
 
 changed:
-	read_unlock(&pointers_lock);
+	read_unlock(pointers_lock(inode));
 	brelse(bh);
 	*err = -EAGAIN;
 	goto no_block;
@@ -67,46 +70,90 @@ no_block:
 	return p;
 }
 
+/*
+ * Where to look for free blocks: right after the last block this inode
+ * got, or failing that after the block before this one in the same
+ * parent, so a file that's written in order ends up in order on disk.
+ */
+static unsigned long find_goal(struct inode *inode, Indirect *partial)
+{
+	block_t *start = partial->bh ? (block_t *)partial->bh->b_data
+				     : i_data(inode);
+	block_t *p;
+	u32 goal = READ_ONCE(cominix_i(inode)->i_alloc_goal);
+
+	if (goal)
+		return goal;
+	for (p = partial->p - 1; p >= start; p--)
+		if (*p)
+			return block_to_cpu(*p) + 1;
+	return partial->bh ? partial->bh->b_blocknr : 0;
+}
+
+/*
+ * Allocates the missing indirect blocks of the branch and up to *count
+ * data blocks next to each other. They are written into the new indirect
+ * blocks here; the top of the branch is hooked in by splice_branch. flags
+ * is for the data, the indirect blocks of delayed data come from the margin.
+ */
 static int alloc_branch(struct inode *inode,
 			     int num,
 			     int *offsets,
-			     Indirect *branch)
+			     Indirect *branch,
+			     unsigned long goal,
+			     int *count,
+			     int flags)
 {
-	int n = 0;
-	int i;
-	int parent = cominix_new_block(inode);
+	struct super_block *sb = inode->i_sb;
+	int n, i, one;
 	int err = -ENOSPC;
+	unsigned long data;
+
+	/* the indirect blocks first, then the data right behind them */
+	for (n = 0; n < num - 1; n++) {
+		one = 1;
+		branch[n].key = cpu_to_block(cominix_new_blocks_sb(sb, goal, &one,
+				flags ? COMINIX_ALLOC_MARGIN : 0));
+		if (!branch[n].key)
+			goto free;
+		goal = block_to_cpu(branch[n].key) + 1;
+	}
+	data = cominix_new_blocks_sb(sb, goal, count, flags);
+	if (!data)
+		goto free;
+	branch[num - 1].key = cpu_to_block(data);
+	WRITE_ONCE(cominix_i(inode)->i_alloc_goal, data + *count);
 
-	branch[0].key = cpu_to_block(parent);
-	if (parent) for (n = 1; n < num; n++) {
+	for (n = 1; n < num; n++) {
 		struct buffer_head *bh;
-		/* Allocate the next block */
-		int nr = cominix_new_block(inode);
-		if (!nr)
-			break;
-		branch[n].key = cpu_to_block(nr);
-		bh = sb_getblk(inode->i_sb, parent);
+		unsigned long parent = block_to_cpu(branch[n - 1].key);
+		bh = sb_getblk(sb, parent);
 		if (!bh) {
-			cominix_free_block(inode, nr);
 			err = -ENOMEM;
-			break;
+			goto free_bh;
 		}
 		lock_buffer(bh);
 		memset(bh->b_data, 0, bh->b_size);
 		branch[n].bh = bh;
 		branch[n].p = (block_t*) bh->b_data + offsets[n];
 		*branch[n].p = branch[n].key;
+		if (n == num - 1)
+			for (i = 1; i < *count; i++)
+				branch[n].p[i] = cpu_to_block(data + i);
 		set_buffer_uptodate(bh);
 		unlock_buffer(bh);
 		mark_buffer_dirty_inode(bh, inode);
-		parent = nr;
 	}
-	if (n == num)
-		return 0;
+	return 0;
 
-	/* Allocation failed, free what we already allocated */
+free_bh:
 	for (i = 1; i < n; i++)
 		bforget(branch[i].bh);
+	for (i = 0; i < *count; i++)
+		cominix_free_block(inode, data + i);
+	n = num - 1;
+free:
+	/* Allocation failed, free what we already allocated */
 	for (i = 0; i < n; i++)
 		cominix_free_block(inode, block_to_cpu(branch[i].key));
 	return err;
@@ -115,19 +162,27 @@ static int alloc_branch(struct inode *inode,
 static inline int splice_branch(struct inode *inode,
 				     Indirect chain[DEPTH],
 				     Indirect *where,
-				     int num)
+				     int num,
+				     int count)
 {
 	int i;
 
-	write_lock(&pointers_lock);
+	write_lock(pointers_lock(inode));
 
 	/* Verify that place we are splicing to is still there and vacant */
-	if (!verify_chain(chain, where-1) || *where->p)
+	if (!verify_chain(chain, where-1))
 		goto changed;
+	/* the data blocks all go in here if there's no new indirect block */
+	for (i = 0; i < (num == 1 ? count : 1); i++)
+		if (where->p[i])
+			goto changed;
 
 	*where->p = where->key;
+	if (num == 1)
+		for (i = 1; i < count; i++)
+			where->p[i] = cpu_to_block(block_to_cpu(where->key) + i);
 
-	write_unlock(&pointers_lock);
+	write_unlock(pointers_lock(inode));
 
 	/* We are done with atomic stuff, now do the rest of housekeeping */
 
@@ -141,14 +196,63 @@ static inline int splice_branch(struct inode *inode,
 	return 0;
 
 changed:
-	write_unlock(&pointers_lock);
+	write_unlock(pointers_lock(inode));
 	for (i = 1; i < num; i++)
 		bforget(where[i].bh);
-	for (i = 0; i < num; i++)
+	for (i = 0; i < num - 1; i++)
 		cominix_free_block(inode, block_to_cpu(where[i].key));
+	for (i = 0; i < count; i++)
+		cominix_free_block(inode, block_to_cpu(where[num - 1].key) + i);
 	return -EAGAIN;
 }
 
+/* pointers from the one for this block to the end of its pointer block */
+static inline int ptrs_left(struct inode *inode, int depth, int *offsets)
+{
+	return depth == 1 ? DIRCOUNT - offsets[0]
+			  : INDIRCOUNT(inode->i_sb) - offsets[depth - 1];
+}
+
+/*
+ * How many blocks from the found one on are also next to each other on
+ * disk, so readahead and writeback can map a whole run with one lookup.
+ * Only looks in the same pointer block, going further means another read.
+ */
+static int blocks_mapped(struct inode *inode, struct buffer_head *bh, int depth,
+			 int *offsets, Indirect *leaf)
+{
+	int max = min_t(int, bh->b_size >> inode->i_blkbits,
+			ptrs_left(inode, depth, offsets));
+	unsigned long first = block_to_cpu(leaf->key);
+	int n;
+
+	read_lock(pointers_lock(inode));
+	for (n = 1; n < max && block_to_cpu(leaf->p[n]) == first + n; n++)
+		;
+	read_unlock(pointers_lock(inode));
+	return n;
+}
+
+/*
+ * How many blocks from the missing one on can be allocated in one go: they
+ * have to be free in the same pointer block, and the caller has to want
+ * them (bh->b_size).
+ */
+static int blocks_wanted(struct inode *inode, struct buffer_head *bh, int depth,
+			 int *offsets, Indirect *partial, int left)
+{
+	int max = clamp_t(int, bh->b_size >> inode->i_blkbits, 1,
+			  ptrs_left(inode, depth, offsets));
+	int n;
+
+	/* a new pointer block is empty, an old one may already have some */
+	if (left > 1)
+		return max;
+	for (n = 1; n < max && !partial->p[n]; n++)
+		;
+	return n;
+}
+
 static int get_block(struct inode * inode, sector_t block,
 			struct buffer_head *bh, int create)
 {
@@ -156,7 +260,7 @@ static int get_block(struct inode * inode, sector_t block,
 	int offsets[DEPTH];
 	Indirect chain[DEPTH];
 	Indirect *partial;
-	int left;
+	int left, count = 1;
 	int depth = block_to_path(inode, block, offsets);
 
 	if (depth == 0)
@@ -168,8 +272,10 @@ reread:
 
 	/* Simplest case - block found, no allocation needed */
 	if (!partial) {
+		count = blocks_mapped(inode, bh, depth, offsets, chain + depth - 1);
 got_it:
 		map_bh(bh, inode->i_sb, block_to_cpu(chain[depth-1].key));
+		bh->b_size = count << inode->i_blkbits;
 		/* Clean up and exit */
 		partial = chain+depth-1; /* the whole chain */
 		goto cleanup;
@@ -195,17 +301,21 @@ out:
 		goto changed;
 
 	left = (chain + depth) - partial;
-	err = alloc_branch(inode, left, offsets+(partial-chain), partial);
+	count = blocks_wanted(inode, bh, depth, offsets, partial, left);
+	err = alloc_branch(inode, left, offsets+(partial-chain), partial,
+			   find_goal(inode, partial), &count,
+			   buffer_delay(bh) ? COMINIX_ALLOC_DELAYED : 0);
 	if (err)
 		goto cleanup;
 
-	if (splice_branch(inode, chain, partial, left) < 0)
+	if (splice_branch(inode, chain, partial, left, count) < 0)
 		goto changed;
 
 	set_buffer_new(bh);
 	goto got_it;
 
 changed:
+	count = 1;
 	while (partial > chain) {
 		brelse(partial->bh);
 		partial--;
@@ -235,11 +345,11 @@ static Indirect *find_shared(struct inode *inode,
 		;
 	partial = get_branch(inode, k, offsets, chain, &err);
 
-	write_lock(&pointers_lock);
+	write_lock(pointers_lock(inode));
 	if (!partial)
 		partial = chain + k-1;
 	if (!partial->key && *partial->p) {
-		write_unlock(&pointers_lock);
+		write_unlock(pointers_lock(inode));
 		goto no_top;
 	}
 	for (p=partial;p>chain && all_zeroes((block_t*)p->bh->b_data,p->p);p--)
@@ -250,7 +360,7 @@ static Indirect *find_shared(struct inode *inode,
 		*top = *p->p;
 		*p->p = 0;
 	}
-	write_unlock(&pointers_lock);
+	write_unlock(pointers_lock(inode));
 
 	while(partial > p)
 	{
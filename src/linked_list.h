@@ -52,6 +52,69 @@ int ll_append(struct super_block *sb, block_t *end, ssize_t *ll_size, struct chu
 	return 0;
 }
 
+/*
+ * Makes the last entry cover size more bytes if it's a hole (and hole is
+ * set) or a run that isn't full yet (and it isn't). Returns whether it did.
+ */
+static
+bool ll_grow_last(struct super_block *sb, block_t end, ssize_t ll_size, u64 size, bool hole)
+{
+	bool grown = false;
+
+	if (!ll_size)
+		return false;
+	struct buffer_head *bh = load_block(sb, end);
+	int i = (ll_size - 1) % entries_per_block(sb);
+	struct chunk_entry *last = (struct chunk_entry *)bh->b_data + i;
+	if (hole && chunk_is_hole(last)) {
+		last->size += size;
+		grown = true;
+	} else if (!hole && !chunk_is_hole(last) &&
+		   chunk_run_members(last) < CHUNK_RUN_MAX &&
+		   last->size + size <= CHUNK_RUN_BYTES) {
+		last->location += 1ULL << CHUNK_LOC_BITS;
+		last->size += size;
+		grown = true;
+	}
+	if (grown)
+		mark_buffer_dirty(bh);
+	brelse(bh);
+	return grown;
+}
+
+//a hole after a hole just makes the first one bigger
+int ll_append_hole(struct super_block *sb, block_t *end, ssize_t *ll_size, u64 size);
+int ll_append_hole(struct super_block *sb, block_t *end, ssize_t *ll_size, u64 size)
+{
+	if (ll_grow_last(sb, *end, *ll_size, size, true))
+		return 0;
+	return ll_append(sb, end, ll_size, (struct chunk_entry){CHUNK_LOC_HOLE, size});
+}
+
+//the caller knows whether the chunk is right after the last one in the heap
+int ll_append_run(struct super_block *sb, block_t *end, ssize_t *ll_size,
+		  struct chunk_entry new_entry, bool adjacent);
+int ll_append_run(struct super_block *sb, block_t *end, ssize_t *ll_size,
+		  struct chunk_entry new_entry, bool adjacent)
+{
+	if (adjacent && ll_grow_last(sb, *end, *ll_size, new_entry.size, false))
+		return 0;
+	return ll_append(sb, end, ll_size, new_entry);
+}
+
+//for throwing away a list that never got attached to an inode
+void ll_free(struct super_block *sb, block_t head);
+void ll_free(struct super_block *sb, block_t head)
+{
+	while (head) {
+		struct buffer_head *bh = load_block(sb, head);
+		block_t next = *ptr_next(sb, bh->b_data);
+		bforget(bh);
+		cominix_free_block_sb(sb, head);
+		head = next;
+	}
+}
+
 struct chunk_entry ll_search_left(struct super_block *sb, block_t head, ssize_t pos, ssize_t *accum);
 //should get tco'd or RIP my 8kb kernel stack
 struct chunk_entry ll_search_left(struct super_block *sb, block_t head, ssize_t pos, ssize_t *accum)
@@ -77,3 +140,66 @@ struct chunk_entry ll_search_left(struct super_block *sb, block_t head, ssize_t
 		return (struct chunk_entry) {0, 0}; //was too large
 	return ll_search_left(sb, next, pos, accum);
 }
+
+/*
+ * Finds the entries covering [pos, end), up to max of them, in one walk of
+ * the list. *start is set to where the first one starts in the file.
+ */
+int ll_collect(struct super_block *sb, block_t head, loff_t pos, loff_t end,
+	       struct chunk_entry *out, int max, loff_t *start);
+int ll_collect(struct super_block *sb, block_t head, loff_t pos, loff_t end,
+	       struct chunk_entry *out, int max, loff_t *start)
+{
+	loff_t accum = 0;
+	int nr = 0;
+
+	while (head && nr < max && accum < end) {
+		struct buffer_head *bh = load_block(sb, head);
+		struct chunk_entry *arr = (void *)bh->b_data;
+		for (int i = 0; i < entries_per_block(sb); i++) {
+			if (arr[i].size == 0 || nr == max || accum >= end)
+				break;
+			if (pos < accum + (loff_t)arr[i].size) {
+				if (!nr)
+					*start = accum;
+				out[nr++] = arr[i];
+			}
+			accum += arr[i].size;
+		}
+		head = *ptr_next(sb, bh->b_data);
+		brelse(bh);
+	}
+	//the next read probably wants it
+	if (head)
+		sb_breadahead(sb, head);
+	return nr;
+}
+
+/*
+ * For SEEK_DATA and SEEK_HOLE. Gives the first offset at or after pos that
+ * is data (or a hole), the end of the file counting as a hole.
+ */
+loff_t ll_seek_hole_data(struct super_block *sb, block_t head, loff_t pos, int whence, loff_t isize);
+loff_t ll_seek_hole_data(struct super_block *sb, block_t head, loff_t pos, int whence, loff_t isize)
+{
+	bool want_hole = whence == SEEK_HOLE;
+	loff_t start = 0;
+
+	while (head) {
+		struct buffer_head *bh = load_block(sb, head);
+		struct chunk_entry *arr = (void *)bh->b_data;
+		for (int i = 0; i < entries_per_block(sb); i++) {
+			if (arr[i].size == 0)
+				break;
+			loff_t end = start + arr[i].size;
+			if (end > pos && chunk_is_hole(&arr[i]) == want_hole) {
+				brelse(bh);
+				return max(start, pos);
+			}
+			start = end;
+		}
+		head = *ptr_next(sb, bh->b_data);
+		brelse(bh);
+	}
+	return want_hole ? isize : -ENXIO;
+}
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * In-memory copies of chunk lists, so reads of a hot chunked file don't walk
+ * the list blocks every time. Built the first time the file is read and
+ * thrown away by a shrinker when memory gets tight.
+ *
+ * A chunked inode's list never changes, so a copy never goes stale. It's
+ * published with RCU and readers don't take any lock.
+ */
+
+#include "cominix.h"
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+//past this many entries a file just uses the list blocks
+#define CACHED_LIST_MAX (256 * 1024)
+
+/*
+ * offs and locs are separate arrays so the binary search over offs only
+ * touches offsets. offs has one more element than locs, the file size.
+ */
+struct cached_list {
+	struct rcu_head rcu;
+	u32 nr;
+	bool referenced; /* read since the shrinker last looked */
+	u64 *offs;
+	u64 *locs;
+};
+
+//walks the list blocks the same way linked_list.h lays them out
+static struct cached_list *cached_list_build(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int per_block = sb->s_blocksize / sizeof(struct chunk_entry) - 1;
+	block_t head = i_data(inode)[1];
+	u32 nr = i_data(inode)[2];
+	struct cached_list *cl;
+	u32 i = 0;
+
+	if (nr > CACHED_LIST_MAX)
+		return NULL;
+	cl = kvmalloc(sizeof(*cl) + (2 * nr + 1) * sizeof(u64), GFP_NOFS);
+	if (!cl)
+		return NULL;
+	cl->nr = nr;
+	cl->referenced = true;
+	cl->offs = (u64 *)(cl + 1);
+	cl->locs = cl->offs + nr + 1;
+	cl->offs[0] = 0;
+
+	while (head && i < nr) {
+		struct buffer_head *bh = load_block(sb, head);
+		struct chunk_entry *arr = (void *)bh->b_data;
+		for (int j = 0; j < per_block && i < nr; j++, i++) {
+			cl->locs[i] = arr[j].location;
+			cl->offs[i + 1] = cl->offs[i] + arr[j].size;
+		}
+		head = *((block_t *)(bh->b_data + sb->s_blocksize) - 1);
+		brelse(bh);
+	}
+	if (WARN_ON(i != nr)) {
+		kvfree(cl);
+		return NULL;
+	}
+	return cl;
+}
+
+static int cached_list_publish(struct inode *inode)
+{
+	struct cominix_sb_info *sbi = cominix_sb(inode->i_sb);
+	struct cominix_inode_info *ci = cominix_i(inode);
+	struct cached_list *cl = cached_list_build(inode);
+
+	if (!cl)
+		return -ENOMEM;
+	spin_lock(&sbi->cached_list_lock);
+	if (rcu_access_pointer(ci->i_cached_list)) {
+		//someone else got there first
+		spin_unlock(&sbi->cached_list_lock);
+		kvfree(cl);
+		return 0;
+	}
+	rcu_assign_pointer(ci->i_cached_list, cl);
+	list_add_tail(&ci->i_cached_lru, &sbi->cached_lists);
+	sbi->nr_cached_lists++;
+	spin_unlock(&sbi->cached_list_lock);
+	return 0;
+}
+
+/*
+ * Same as ll_collect, but from the cached copy (which gets built if it
+ * isn't there). Returns -ENOMEM if there's no copy and the caller should
+ * walk the list blocks itself.
+ */
+int cached_list_collect(struct inode *inode, loff_t pos, loff_t end,
+			struct chunk_entry *out, int max, loff_t *start)
+{
+	struct cominix_inode_info *ci = cominix_i(inode);
+	struct cached_list *cl;
+	int nr = 0;
+
+	rcu_read_lock();
+	cl = rcu_dereference(ci->i_cached_list);
+	if (!cl) {
+		rcu_read_unlock();
+		if (cached_list_publish(inode))
+			return -ENOMEM;
+		rcu_read_lock();
+		cl = rcu_dereference(ci->i_cached_list);
+		if (!cl) {
+			//the shrinker was quicker
+			rcu_read_unlock();
+			return -ENOMEM;
+		}
+	}
+	if (!READ_ONCE(cl->referenced))
+		WRITE_ONCE(cl->referenced, true);
+
+	//the last entry that starts at or before pos
+	u32 lo = 0, hi = cl->nr;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (cl->offs[mid] <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (cl->nr && pos < cl->offs[cl->nr]) {
+		*start = cl->offs[lo];
+		for (u32 i = lo; i < cl->nr && nr < max && cl->offs[i] < end; i++) {
+			out[nr].location = cl->locs[i];
+			out[nr].size = cl->offs[i + 1] - cl->offs[i];
+			nr++;
+		}
+	}
+	rcu_read_unlock();
+	return nr;
+}
+
+//for evict, when nobody can be reading anymore
+void cached_list_drop(struct inode *inode)
+{
+	struct cominix_sb_info *sbi = cominix_sb(inode->i_sb);
+	struct cominix_inode_info *ci = cominix_i(inode);
+	struct cached_list *cl;
+
+	if (!rcu_access_pointer(ci->i_cached_list))
+		return;
+	spin_lock(&sbi->cached_list_lock);
+	cl = rcu_dereference_protected(ci->i_cached_list,
+				       lockdep_is_held(&sbi->cached_list_lock));
+	if (cl) {
+		list_del_init(&ci->i_cached_lru);
+		RCU_INIT_POINTER(ci->i_cached_list, NULL);
+		sbi->nr_cached_lists--;
+	}
+	spin_unlock(&sbi->cached_list_lock);
+	if (cl)
+		kvfree_rcu(cl, rcu);
+}
+
+static unsigned long cached_list_count(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct cominix_sb_info *sbi = shrink->private_data;
+
+	return READ_ONCE(sbi->nr_cached_lists);
+}
+
+//oldest first, but a list that was read since the last pass gets another go
+static unsigned long cached_list_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct cominix_sb_info *sbi = shrink->private_data;
+	unsigned long freed = 0;
+
+	spin_lock(&sbi->cached_list_lock);
+	while (sc->nr_to_scan && !list_empty(&sbi->cached_lists)) {
+		struct cominix_inode_info *ci = list_first_entry(&sbi->cached_lists,
+				struct cominix_inode_info, i_cached_lru);
+		struct cached_list *cl = rcu_dereference_protected(ci->i_cached_list,
+				lockdep_is_held(&sbi->cached_list_lock));
+		sc->nr_to_scan--;
+		if (cl->referenced) {
+			cl->referenced = false;
+			list_move_tail(&ci->i_cached_lru, &sbi->cached_lists);
+			continue;
+		}
+		list_del_init(&ci->i_cached_lru);
+		RCU_INIT_POINTER(ci->i_cached_list, NULL);
+		sbi->nr_cached_lists--;
+		kvfree_rcu(cl, rcu);
+		freed++;
+	}
+	spin_unlock(&sbi->cached_list_lock);
+	return freed;
+}
+
+int cached_list_init_sb(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+	struct shrinker *shrink;
+
+	spin_lock_init(&sbi->cached_list_lock);
+	INIT_LIST_HEAD(&sbi->cached_lists);
+	shrink = shrinker_alloc(0, "cominix-lists:%s", sb->s_id);
+	if (!shrink)
+		return -ENOMEM;
+	shrink->count_objects = cached_list_count;
+	shrink->scan_objects = cached_list_scan;
+	shrink->private_data = sbi;
+	shrinker_register(shrink);
+	sbi->cached_list_shrinker = shrink;
+	return 0;
+}
+
+//the inodes are all gone by now, so the lists are too
+void cached_list_exit_sb(struct super_block *sb)
+{
+	struct cominix_sb_info *sbi = cominix_sb(sb);
+
+	shrinker_free(sbi->cached_list_shrinker);
+	WARN_ON(sbi->nr_cached_lists);
+}
@@ -56,3 +56,52 @@ int md5_hash(const unsigned char *data, unsigned int datalen,
 	crypto_free_shash(alg);
 	return ret;
 }
+
+/*
+ * For hashing something that doesn't fit in one buffer, like a whole file.
+ * md5_stream_end frees the stream even if it fails.
+ */
+struct sdesc *md5_stream_start(void);
+struct sdesc *md5_stream_start(void)
+{
+	struct crypto_shash *alg;
+	struct sdesc *sdesc;
+	int ret;
+
+	alg = crypto_alloc_shash("md5", 0, 0);
+	if (IS_ERR(alg)) {
+		pr_info("can't alloc alg md5\n");
+		return ERR_CAST(alg);
+	}
+	sdesc = init_sdesc(alg);
+	if (IS_ERR(sdesc)) {
+		crypto_free_shash(alg);
+		return sdesc;
+	}
+	ret = crypto_shash_init(&sdesc->shash);
+	if (ret) {
+		kfree(sdesc);
+		crypto_free_shash(alg);
+		return ERR_PTR(ret);
+	}
+	return sdesc;
+}
+
+int md5_stream_update(struct sdesc *sdesc, const unsigned char *data,
+		      unsigned int datalen);
+int md5_stream_update(struct sdesc *sdesc, const unsigned char *data,
+		      unsigned int datalen)
+{
+	return crypto_shash_update(&sdesc->shash, data, datalen);
+}
+
+int md5_stream_end(struct sdesc *sdesc, unsigned char *digest);
+int md5_stream_end(struct sdesc *sdesc, unsigned char *digest)
+{
+	struct crypto_shash *alg = sdesc->shash.tfm;
+	int ret = crypto_shash_final(&sdesc->shash, digest);
+
+	kfree(sdesc);
+	crypto_free_shash(alg);
+	return ret;
+}